@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+
+#include "server.h"
+#include "probe_header.h"
+
+/** the longest encoded arrival record: four varints of at most 10, 5, 3 and 3 bytes */
+#define TRACE_RECORD_MAX 21
+/** the first bytes of a trace file */
+#define TRACE_MAGIC "CDTRACE1"
+/** `flags` bit of a trace file whose arena filled up before the session ended */
+#define TRACE_TRUNCATED 1
+
+/** 
+ * Fixed layout header of a trace file, in host byte order, followed by `data_len` bytes of 
+ * arrival records. Each record is four LEB128 varints: the arrival time minus the previous 
+ * arrival time in ns (zigzag encoded, the first one relative to `t0_ns`), the sequence 
+ * number, the train ID and the UDP payload length of the packet.
+ */
+struct trace_file_header {
+	char magic[8]; // TRACE_MAGIC
+	uint32_t session_id;
+	uint16_t num_trains;
+	uint16_t flags; // TRACE_TRUNCATED
+	uint32_t n; // the number of packets per train
+	uint32_t l; // the UDP payload length sent by the client
+	uint64_t t0_ns; // the time (CLOCK_REALTIME) the client was told to send, in ns since the epoch
+	uint64_t num_records;
+	uint64_t data_len; // the bytes of records following the header
+	uint8_t entropy_levels[MAX_TRAINS];
+};
+
+/** 
+ * This function allocates the arenas of the arrival traces once, when the server starts. The 
+ * traces are written to `dir` when their session ends.
+ * 
+ * @param server The server.
+ * @param dir The directory the traces are written to, an absolute path.
+ * @return void. Exits the program on failure.
+ */
+void setup_arrival_traces(struct probe_server *server, const char *dir) {
+	server->traces = calloc(TRACE_ARENAS, sizeof(struct arrival_trace));
+	if (server->traces == NULL) {
+		perror("Failed to allocate memory for the arrival traces");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < TRACE_ARENAS; i++) {
+		server->traces[i].dir = dir;
+		server->traces[i].arena = malloc(TRACE_ARENA_SIZE);
+		if (server->traces[i].arena == NULL) {
+			perror("Failed to allocate memory for the arrival traces");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/** 
+ * This function takes a free trace for a session that starts receiving, with its arrivals 
+ * counted from now.
+ * 
+ * @param server The server.
+ * @return The emptied trace, or NULL if the arrivals are not traced or all the traces are in use.
+ */
+struct arrival_trace *acquire_trace(struct probe_server *server) {
+	if (server->traces == NULL) return NULL;
+	for (int i = 0; i < TRACE_ARENAS; i++) {
+		struct arrival_trace *trace = &server->traces[i];
+		if (trace->in_use) continue;
+		trace->in_use = 1;
+		trace->num_records = 0;
+		trace->used = 0;
+		trace->truncated = 0;
+		clock_gettime(CLOCK_REALTIME, &trace->t0);
+		trace->t_prev = trace->t0;
+		return trace;
+	}
+	printf("All the arrival traces are in use, the session is not traced\n");
+	return NULL;
+}
+
+/** 
+ * This function appends `value` to `p` as a LEB128 varint: 7 bits per byte, low bits first.
+ * @return The number of bytes written.
+ */
+int put_varint(unsigned char *p, uint64_t value) {
+	int i = 0;
+	while (value >= 0x80) {
+		p[i++] = (unsigned char) (value | 0x80);
+		value >>= 7;
+	}
+	p[i++] = (unsigned char) value;
+	return i;
+}
+
+/** 
+ * This function appends one arrival to the trace of a session: the sequence number and train of 
+ * the packet from its probe header, its length and its arrival time as the delta to the previous 
+ * arrival, which takes 1 to 3 bytes within a train. Packets that do not belong to the session are 
+ * not recorded. Once the arena is full, the trace is marked truncated.
+ * 
+ * @param trace The trace of the session.
+ * @param configs A pointer to the `configurations` structure of the session.
+ * @param buf The received payload.
+ * @param len The length of the received payload.
+ * @param ts The arrival time of the packet.
+ */
+void trace_arrival(struct arrival_trace *trace, struct configurations *configs, unsigned char *buf, int len, 
+	struct timespec *ts) {
+	int train_id = classify_packet(buf, len, configs);
+	if (train_id == -1) return;
+	struct probe_header *header = (struct probe_header *) buf;
+
+	// a session is one flow and read by one thread, so the lock is only ever contended by accident
+	while (__atomic_exchange_n(&trace->lock, 1, __ATOMIC_ACQUIRE)) ;
+	if (trace->used + TRACE_RECORD_MAX > TRACE_ARENA_SIZE) {
+		trace->truncated = 1;
+	} else {
+		int64_t delta = (ts->tv_sec - trace->t_prev.tv_sec) * 1000000000L + (ts->tv_nsec - trace->t_prev.tv_nsec);
+		unsigned char *p = trace->arena + trace->used;
+		p += put_varint(p, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+		p += put_varint(p, ntohl(header->seq));
+		p += put_varint(p, train_id);
+		p += put_varint(p, len);
+		trace->used = p - trace->arena;
+		trace->t_prev = *ts;
+		trace->num_records++;
+	}
+	__atomic_store_n(&trace->lock, 0, __ATOMIC_RELEASE);
+}
+
+/** 
+ * This function writes the trace of a session that ended to `<dir>/compdetect_<session_id>_<t0>.trace`: 
+ * the file is sized for the header and the records, mapped, and filled with one copy of the arena.
+ * A failure is reported and only loses the trace.
+ * 
+ * @param trace The trace of the session.
+ * @param configs A pointer to the `configurations` structure of the session.
+ */
+void export_trace(struct arrival_trace *trace, struct configurations *configs) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/compdetect_%u_%ld.trace", trace->dir, configs->session_id, (long) trace->t0.tv_sec);
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		perror("Failed to create trace file");
+		return;
+	}
+	size_t file_len = sizeof(struct trace_file_header) + trace->used;
+	if (ftruncate(fd, file_len) == -1) {
+		perror("Failed to size trace file");
+		close(fd);
+		return;
+	}
+	unsigned char *file = mmap(NULL, file_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (file == MAP_FAILED) {
+		perror("Failed to map trace file");
+		return;
+	}
+
+	struct trace_file_header *header = (struct trace_file_header *) file;
+	memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+	header->session_id = configs->session_id;
+	header->num_trains = configs->num_trains;
+	header->flags = trace->truncated ? TRACE_TRUNCATED : 0;
+	header->n = configs->n;
+	header->l = configs->l;
+	header->t0_ns = (uint64_t) trace->t0.tv_sec * 1000000000ULL + trace->t0.tv_nsec;
+	header->num_records = trace->num_records;
+	header->data_len = trace->used;
+	memcpy(header->entropy_levels, configs->entropy_levels, sizeof(header->entropy_levels));
+	memcpy(file + sizeof(struct trace_file_header), trace->arena, trace->used);
+	munmap(file, file_len);
+	printf("Arrival trace of session %u: %lu packets in %s\n", configs->session_id, 
+		(unsigned long) trace->num_records, path);
+}
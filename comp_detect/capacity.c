@@ -0,0 +1,138 @@
+#include <math.h>
+#include <stdint.h>
+
+#include "server.h"
+
+/** 
+ * This function estimates the rate the bottleneck of the path forwarded a train at: the payload bits
+ * of the received packets over the dispersion of the train (the packets after the first one, unless
+ * the trains are interleaved and the dispersion is the busy time of all of them).
+ * 
+ * The confidence interval comes from the SPRT_BLOCK packet blocks of the train: with the mean block
+ * duration m, its standard error se over the timed blocks and ESTIMATE_Z for 95%, the rate lies
+ * between the rates of blocks lasting m + ESTIMATE_Z * se and m - ESTIMATE_Z * se. A lost packet
+ * either never reached the bottleneck, or it took its share of the bottleneck and was dropped behind
+ * it, in which case the bottleneck was faster than the received packets show by up to
+ * `expected` / `count`, so the upper bound is widened by that factor.
+ * 
+ * @param configs A pointer to the `configurations` structure of the session.
+ * @param train The arrival statistics of the train.
+ * @param expected The number of packets of the train that were sent and should have arrived.
+ * @param est Set to the estimated rate (in bits per second) and its confidence interval.
+ * 
+ * @return 0 on success, -1 if the train has too few packets or blocks to estimate its rate.
+ */
+int estimate_capacity(struct configurations *configs, struct train_stats *train, uint32_t expected,
+		struct estimate *est) {
+	long dispersion_ns = train_dispersion_ns(configs, train);
+	uint32_t packets = configs->interleave > 0 ? train->count : train->count - 1;
+	if (train->count < 2 || dispersion_ns <= 0 || train->blocks < 2) return -1;
+	double bits = (double) configs->l * 8;
+	est->value = packets * bits / (dispersion_ns / 1e9);
+
+	double mean = (double) train->block_sum_ns / train->blocks;
+	double variance = (train->block_sq_ns - train->blocks * mean * mean) / (train->blocks - 1);
+	double margin = ESTIMATE_Z * sqrt(variance > 0 ? variance / train->blocks : 0);
+	double loss = expected > train->count ? (double) expected / train->count : 1;
+	est->low = SPRT_BLOCK * bits / ((mean + margin) / 1e9);
+	// an upper bound at or below zero block duration is unbounded
+	est->high = mean > margin ? loss * SPRT_BLOCK * bits / ((mean - margin) / 1e9) : INFINITY;
+	// the rate of the whole train is the better point estimate, but it must lie in its interval
+	if (est->value < est->low) est->low = est->value;
+	if (est->value > est->high) est->high = est->value;
+	return 0;
+}
+
+/** 
+ * This function estimates the compression ratio the bottleneck achieved: the rate of the low entropy
+ * train over the rate of the high entropy train, with the interval spanned by the extremes of their
+ * confidence intervals.
+ * 
+ * @param low The capacity estimate of the lowest entropy train.
+ * @param high The capacity estimate of the highest entropy train.
+ * @param est Set to the ratio and its confidence interval.
+ */
+void estimate_compression_ratio(struct estimate *low, struct estimate *high, struct estimate *est) {
+	est->value = low->value / high->value;
+	est->low = low->low / high->high;
+	est->high = low->high / high->low;
+}
+
+/** 
+ * This function estimates the one-way delay trend of a train: the slope of the least squares line 
+ * through the relative one-way delays of its packets over their send times, i.e. how much longer 
+ * every packet queued than the one sent before it, per unit of send time. A bottleneck slower than 
+ * the sender builds up a queue, so the slope grows with the time the bottleneck spends per packet, 
+ * and a slope fitted over every packet is far less noisy than the difference of the first and the 
+ * last arrival. The confidence interval is ESTIMATE_Z standard errors of the slope around it.
+ * 
+ * @param train The arrival statistics of the train.
+ * @param est Set to the slope (nanos of delay per nano of send time) and its confidence interval.
+ * 
+ * @return 0 on success, -1 if the train has fewer than 3 packets or all its packets were sent at once.
+ */
+int estimate_delay_trend(struct train_stats *train, struct estimate *est) {
+	if (train->count < 3 || train->owd_m2_x <= 0) return -1;
+	est->value = train->owd_c_xy / train->owd_m2_x;
+	double residuals = train->owd_m2_y - train->owd_c_xy * est->value;
+	double se = sqrt((residuals > 0 ? residuals : 0) / (train->count - 2) / train->owd_m2_x);
+	est->low = est->value - ESTIMATE_Z * se;
+	est->high = est->value + ESTIMATE_Z * se;
+	return 0;
+}
+
+/** 
+ * This function returns the bucket of the inter-arrival gap histogram a gap falls in. Gaps below 
+ * 2^GAP_HIST_SUB_BITS nanos have a bucket each; every larger power of 2 is split into 
+ * 2^GAP_HIST_SUB_BITS buckets of equal width, so a bucket is at most 1 / 2^GAP_HIST_SUB_BITS of its 
+ * gaps wide, from nanos to seconds, in a fixed GAP_HIST_BUCKETS counters. The bucket is found from the 
+ * leading bit of the gap and the bits below it, with no search.
+ * 
+ * @param gap_ns The gap in nanos.
+ * @return The bucket, between 0 and GAP_HIST_BUCKETS - 1.
+ */
+int gap_bucket(long gap_ns) {
+	if (gap_ns < (1L << GAP_HIST_SUB_BITS)) return gap_ns > 0 ? gap_ns : 0;
+	if (gap_ns >= (1L << GAP_HIST_MAX_EXP)) return GAP_HIST_BUCKETS - 1;
+	int exp = 63 - __builtin_clzl(gap_ns);
+	int sub = (gap_ns >> (exp - GAP_HIST_SUB_BITS)) & ((1 << GAP_HIST_SUB_BITS) - 1);
+	return ((exp - GAP_HIST_SUB_BITS + 1) << GAP_HIST_SUB_BITS) + sub;
+}
+
+/** 
+ * This function returns the smallest gap in a bucket of the inter-arrival gap histogram, the inverse 
+ * of `gap_bucket`. A bucket holds the gaps from its own lower bound up to the lower bound of the next.
+ * 
+ * @param bucket The bucket, between 0 and GAP_HIST_BUCKETS - 1.
+ * @return The lower bound of the bucket in nanos.
+ */
+long gap_bucket_low(int bucket) {
+	if (bucket < (1 << GAP_HIST_SUB_BITS)) return bucket;
+	int exp = (bucket >> GAP_HIST_SUB_BITS) + GAP_HIST_SUB_BITS - 1;
+	long sub = bucket & ((1 << GAP_HIST_SUB_BITS) - 1);
+	return ((1L << GAP_HIST_SUB_BITS) + sub) << (exp - GAP_HIST_SUB_BITS);
+}
+
+/** 
+ * This function estimates a percentile of the inter-arrival gaps of a train from its histogram: the 
+ * middle of the bucket holding the gap of that rank, within the smallest and the largest gap seen.
+ * 
+ * @param train The arrival statistics of the train.
+ * @param q The percentile, between 0 and 1 (e.g. 0.99).
+ * @return The gap in nanos, or -1 if the train has fewer than 2 packets.
+ */
+long gap_percentile(struct train_stats *train, double q) {
+	uint64_t total = 0;
+	for (int b = 0; b < GAP_HIST_BUCKETS; b++) total += train->gap_hist[b];
+	if (total == 0) return -1;
+	uint64_t rank = (uint64_t) ceil(q * total), seen = 0;
+	if (rank == 0) rank = 1;
+	int bucket = 0;
+	while ((seen += train->gap_hist[bucket]) < rank) bucket++;
+	long low = gap_bucket_low(bucket);
+	long high = bucket + 1 < GAP_HIST_BUCKETS ? gap_bucket_low(bucket + 1) : train->gap_max_ns + 1;
+	long gap_ns = low + (high - 1 - low) / 2;
+	if (gap_ns < train->gap_min_ns) gap_ns = train->gap_min_ns;
+	if (gap_ns > train->gap_max_ns) gap_ns = train->gap_max_ns;
+	return gap_ns;
+}
@@ -1,21 +1,50 @@
 #include <stdint.h>
+#include <pthread.h>
+#include "probe_header.h"
 #define ADDR_LEN 32
-#define FIX_DATA_LEN 10
+/** the size of the buffer holding the detection result pushed by the server */
+#define RESULT_BUF_SIZE 4096
+/** the longest path of the file the structured result is written to */
+#define REPORT_FILE_LEN 256
 
 struct configurations {
 	char server_ip_addr[ADDR_LEN];
 	uint16_t server_port_preprobing;
-	uint16_t server_port_postprobing;
 	uint16_t udp_src_port;
 	uint16_t udp_dst_port;
-	unsigned char udp_head_bytes[FIX_DATA_LEN]; // the first 10 bytes after packet id in udp packet payload
 	uint32_t l; // the Size of the UDP Payload in a UDP Packet
 	uint32_t n; // the Number of Packets in the UDP Packet Train
 	uint16_t gamma; // inter-measurement time, γ
+	uint32_t session_id; // tags the UDP Packets of this session, sent to the server with the configurations
+	uint16_t num_trains; // the Number of UDP Packet Trains sent in the session
+	uint8_t entropy_levels[MAX_TRAINS]; // the entropy level of each UDP Packet Train (ENTROPY_*)
+	int send_mode; // the engine handing the UDP Packet Train to the kernel (SEND_MODE_*)
+	uint32_t batch_size; // the Number of Packets handed to the kernel per send syscall
+	double rate_pps; // the Rate (packets per second) the UDP Packet Train is paced at, 0 for unpaced
+	int pacing; // the method used to pace the UDP Packet Train (PACING_*)
+	uint32_t interleave; // the Number of consecutive Packets of a train when the trains are interleaved, 0 sends them one after another
+	int tx_timestamps; // report the departure dispersion of every train to the server, from its TX timestamps
+	char report_file[REPORT_FILE_LEN]; // the file the structured result (JSON) is written to, "-" for the console, "" for none
 };
 
-void pre_probe(char *, struct configurations *);
+/** The control channel while the trains are sent: a thread waits for the server to stop them or push its result */
+struct control_listener {
+	int ctrl_sock; // the control channel opened in pre-probing phase
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // signalled when `stop` is set
+	int stop; // set once the server sent CTRL_STOP or its result; the trains end early
+	int failed; // set if the control channel failed before the result arrived
+	char result[RESULT_BUF_SIZE];
+	uint32_t result_len;
+};
+
+int pre_probe(char *, struct configurations *);
+
+void start_control_listener(struct control_listener *, int);
+
+int wait_for_stop(struct control_listener *, int);
 
-void probe(struct configurations *);
+void probe(struct configurations *, struct control_listener *);
 
-void post_probe(struct configurations *);
+void post_probe(struct configurations *, struct control_listener *);
@@ -1,10 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <cjson/cJSON.h>
 
 #include "standalone.h" 
 #include "default.h"
+#include "train_sender.h"
+#include "probe_header.h"
 
 #define BUFFER_SIZE 1024
 
@@ -108,6 +111,10 @@ void parse_configs(char* file_name, char *buffer, struct configurations *configs
 	} else {
 		configs->n = DEFAULT_N;
 	}
+	if (configs->l < PROBE_HEADER_LEN) {
+		printf("l must be at least %zu bytes. \n", PROBE_HEADER_LEN);
+		exit(EXIT_FAILURE);
+	}
 
 	name = cJSON_GetObjectItemCaseSensitive(json,"gamma"); 	
 	if (cJSON_IsNumber(name)) {
@@ -129,6 +136,58 @@ void parse_configs(char* file_name, char *buffer, struct configurations *configs
 	} else {
 		configs->ttl = DEFAULT_TTL;
 	}
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"send_mode");
+	configs->send_mode = parse_send_mode(cJSON_IsString(name) && (name->valuestring != NULL) ? 
+		name->valuestring : DEFAULT_SEND_MODE);
+	if (configs->send_mode == -1) {
+		printf("send_mode is not set correctly. \n");
+		exit(EXIT_FAILURE);
+	}
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"batch_size");
+	if (cJSON_IsNumber(name)) {
+		configs->batch_size = name->valueint;
+	} else {
+		configs->batch_size = DEFAULT_BATCH_SIZE;
+	}
+
+	// the pacing rate is given in packets per second, or in bits per second on the wire
+	name = cJSON_GetObjectItemCaseSensitive(json,"rate_pps");
+	cJSON *rate_bps = cJSON_GetObjectItemCaseSensitive(json,"rate_bps");
+	if (cJSON_IsNumber(name)) {
+		configs->rate_pps = name->valuedouble;
+	} else if (cJSON_IsNumber(rate_bps)) {
+		configs->rate_pps = rate_bps->valuedouble / ((configs->l + UDP_IP_OVERHEAD) * 8.0);
+	} else {
+		configs->rate_pps = DEFAULT_RATE_PPS;
+	}
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"pacing");
+	configs->pacing = parse_pacing(cJSON_IsString(name) && (name->valuestring != NULL) ? 
+		name->valuestring : DEFAULT_PACING);
+	if (configs->pacing == -1) {
+		printf("pacing is not set correctly. \n");
+		exit(EXIT_FAILURE);
+	}
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"tx_ring");
+	configs->tx_ring = cJSON_IsBool(name) ? cJSON_IsTrue(name) : cJSON_IsNumber(name) && name->valueint;
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"ifname");
+	if (cJSON_IsString(name) && (name->valuestring != NULL)) {
+		strncpy(configs->ifname, name->valuestring, IFNAMSIZ - 1);
+	}
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"next_hop_mac");
+	if (cJSON_IsString(name) && (name->valuestring != NULL)) {
+		strncpy(configs->next_hop_mac, name->valuestring, MAC_STR_LEN - 1);
+	}
+
+	if (getrandom(&configs->session_id, sizeof(configs->session_id), 0) != sizeof(configs->session_id)) {
+		perror("Failed to generate session id");
+		exit(EXIT_FAILURE);
+	}
 	  
 	// delete the JSON object 
 	cJSON_Delete(json);  
@@ -2,20 +2,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/random.h>
 #include <cjson/cJSON.h>
 
 #include "client.h" 
 #include "default.h"
+#include "entropy_levels.h"
+#include "train_sender.h"
+#include "probe_header.h"
 
 #define BUFFER_SIZE 1024
-#define SERVER_PREP_TIME 2
-#define WAIT_TIME 60
 
 /** 
  * This function reads a JSON configuration file, parses its contents, extracts 
  * configuration values, and stores them in the provided `configs` structure. If 
  * a specific field doesn't exist in the json file, set the field of `configs`
- * to default value (defined in default.h).
+ * to default value (defined in default.h). A random `session_id` is added to the 
+ * configurations in `buffer` unless the file sets one.
  * 
  * @param file_name The name of the configuration file to be parsed.
  * @param buffer A buffer where the contents of the configuration file will be stored temporarily.
@@ -62,13 +65,6 @@ void parse_configs(char* file_name, char *buffer, struct configurations *configs
 		configs->server_port_preprobing = DEFAULT_SERVER_PORT_PREPROBING;
 	}
 
-	name = cJSON_GetObjectItemCaseSensitive(json,"server_port_postprobing"); 
-	if (cJSON_IsNumber(name)) { 
-		configs->server_port_postprobing = name->valueint;
-	} else {
-		configs->server_port_postprobing = DEFAULT_SERVER_PORT_POSTPROBING;
-	}
-	
 	name = cJSON_GetObjectItemCaseSensitive(json,"udp_src_port"); 
 	if (cJSON_IsNumber(name)) { 
 		configs->udp_src_port = name->valueint;
@@ -83,13 +79,6 @@ void parse_configs(char* file_name, char *buffer, struct configurations *configs
 		configs->udp_dst_port = DEFAULT_UDP_DST_PORT;
 	}
 
-	name = cJSON_GetObjectItemCaseSensitive(json,"udp_head_bytes"); 
-	if (cJSON_IsString(name) && (name->valuestring != NULL)) { 
-	    memcpy(configs->udp_head_bytes, name->valuestring, FIX_DATA_LEN);
-	} else {
-		memcpy(configs->udp_head_bytes, DEFAULT_UDP_HEAD_BYTES, FIX_DATA_LEN);
-	}
-
 	name = cJSON_GetObjectItemCaseSensitive(json,"l");
 	if (cJSON_IsNumber(name)) {
 		configs->l = name->valueint;
@@ -103,6 +92,10 @@ void parse_configs(char* file_name, char *buffer, struct configurations *configs
 	} else {
 		configs->n = DEFAULT_N;
 	}
+	if (configs->l < PROBE_HEADER_LEN) {
+		printf("l must be at least %zu bytes. \n", PROBE_HEADER_LEN);
+		exit(EXIT_FAILURE);
+	}
 
 	name = cJSON_GetObjectItemCaseSensitive(json,"gamma"); 	
 	if (cJSON_IsNumber(name)) {
@@ -110,6 +103,92 @@ void parse_configs(char* file_name, char *buffer, struct configurations *configs
 	} else {
 		configs->gamma = DEFAULT_GAMMA;
 	}
+
+	if (parse_entropy_levels(json, configs->entropy_levels, &configs->num_trains) == -1) {
+		exit(EXIT_FAILURE);
+	}
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"calibrate");
+	if (cJSON_IsBool(name) ? cJSON_IsTrue(name) : cJSON_IsNumber(name) ? name->valueint : DEFAULT_CALIBRATE) {
+		if (configs->num_trains + CALIBRATION_TRAINS > MAX_TRAINS) {
+			printf("entropy_levels can have at most %d levels with calibrate. \n", MAX_TRAINS - CALIBRATION_TRAINS);
+			exit(EXIT_FAILURE);
+		}
+		// the baseline trains the server calibrates its threshold with go first
+		memmove(configs->entropy_levels + CALIBRATION_TRAINS, configs->entropy_levels, configs->num_trains);
+		memset(configs->entropy_levels, ENTROPY_LOW, CALIBRATION_TRAINS);
+		configs->num_trains += CALIBRATION_TRAINS;
+	}
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"send_mode");
+	configs->send_mode = parse_send_mode(cJSON_IsString(name) && (name->valuestring != NULL) ? 
+		name->valuestring : DEFAULT_SEND_MODE);
+	if (configs->send_mode == -1) {
+		printf("send_mode is not set correctly. \n");
+		exit(EXIT_FAILURE);
+	}
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"batch_size");
+	if (cJSON_IsNumber(name)) {
+		configs->batch_size = name->valueint;
+	} else {
+		configs->batch_size = DEFAULT_BATCH_SIZE;
+	}
+
+	// the pacing rate is given in packets per second, or in bits per second on the wire
+	name = cJSON_GetObjectItemCaseSensitive(json,"rate_pps");
+	cJSON *rate_bps = cJSON_GetObjectItemCaseSensitive(json,"rate_bps");
+	if (cJSON_IsNumber(name)) {
+		configs->rate_pps = name->valuedouble;
+	} else if (cJSON_IsNumber(rate_bps)) {
+		configs->rate_pps = rate_bps->valuedouble / ((configs->l + UDP_IP_OVERHEAD) * 8.0);
+	} else {
+		configs->rate_pps = DEFAULT_RATE_PPS;
+	}
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"pacing");
+	configs->pacing = parse_pacing(cJSON_IsString(name) && (name->valuestring != NULL) ? 
+		name->valuestring : DEFAULT_PACING);
+	if (configs->pacing == -1) {
+		printf("pacing is not set correctly. \n");
+		exit(EXIT_FAILURE);
+	}
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"interleave");
+	if (cJSON_IsNumber(name) && name->valueint >= 0) {
+		configs->interleave = name->valueint;
+	} else {
+		configs->interleave = DEFAULT_INTERLEAVE;
+	}
+
+	// the departures of interleaved trains are not timestamped, their dispersion is measured by busy time
+	name = cJSON_GetObjectItemCaseSensitive(json,"tx_timestamps");
+	configs->tx_timestamps = (cJSON_IsBool(name) ? cJSON_IsTrue(name) : cJSON_IsNumber(name) ? name->valueint : DEFAULT_TX_TIMESTAMPS) && 
+		configs->interleave == 0;
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"report_file");
+	char *report_file = cJSON_IsString(name) && (name->valuestring != NULL) ? name->valuestring : DEFAULT_REPORT_FILE;
+	if (strlen(report_file) >= REPORT_FILE_LEN) {
+		printf("report_file is not set correctly. \n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(configs->report_file, report_file);
+
+	// Tag the session so the server can tell its packets apart; the tag is sent with the configurations
+	name = cJSON_GetObjectItemCaseSensitive(json,"session_id");
+	if (cJSON_IsNumber(name)) {
+		configs->session_id = (uint32_t) name->valuedouble;
+	} else {
+		if (getrandom(&configs->session_id, sizeof(configs->session_id), 0) != sizeof(configs->session_id)) {
+			perror("Failed to generate session id");
+			exit(EXIT_FAILURE);
+		}
+		cJSON_AddNumberToObject(json, "session_id", configs->session_id);
+		if (!cJSON_PrintPreallocated(json, buffer, BUFFER_SIZE, 0)) {
+			printf("Configuration file is too large. \n");
+			exit(EXIT_FAILURE);
+		}
+	}
 	  
 	// delete the JSON object 
 	cJSON_Delete(json);  
@@ -135,23 +214,19 @@ int main(int argc, char* argv[]) {
 	char* file_name = argv[1];
 	parse_configs(file_name, buffer, &configs);
 
-	/** Execute pre probing phase */
-	pre_probe(buffer, &configs);
-	
-	/** Wait a reasonabal time, to make sure when the client starts to send UDP packets, 
-	the server has completed pre-probing phase and has started to recv in probing phase */
-	sleep(SERVER_PREP_TIME);
-	
-	/** Execute probing phase */
-	probe(&configs);
+	/** Execute pre probing phase, the connection stays open as the control channel and 
+	returns once the server is ready to receive the UDP packets */
+	int ctrl_sock = pre_probe(buffer, &configs);
 	
-	/** Wait a reasonabally long time, to make sure when the client starts need to 
-	initialize the post-probing connection with the server, the server has completed 
-	probing phase and is ready to receive the connection */
-	sleep(WAIT_TIME);
+	/** Execute probing phase, while a thread watches the control channel for the server 
+	to stop the trains early */
+	struct control_listener listener;
+	start_control_listener(&listener, ctrl_sock);
+	probe(&configs, &listener);
 	
-	/** Execute post probing phase */
-	post_probe(&configs);
+	/** Execute post probing phase, the server pushes the result over the control channel 
+	as soon as it has completed probing phase */
+	post_probe(&configs, &listener);
 	
 	return EXIT_SUCCESS;
 }
@@ -2,21 +2,91 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <cjson/cJSON.h>
 #include "server.h"
 #include "default.h"
+#include "entropy_levels.h"
+#include "probe_header.h"
 
-#define BUFFER_SIZE 1024
+/** the size of the arena the JSON configurations of a session are parsed in */
+#define CONFIG_ARENA_SIZE 65536
+
+/** cJSON allocates from this arena, which is reset for every session instead of freed */
+static unsigned char config_arena[CONFIG_ARENA_SIZE] __attribute__((aligned(16)));
+static size_t config_arena_used = 0;
 
 /** 
- * This function parse the server's preprobing port number from command line argument.
+ * This function is the allocator of cJSON: it hands out the next 16-byte aligned block of the arena.
+ * @param size The number of bytes to allocate.
+ * @return The block, or NULL if the arena is full, which makes parsing fail.
+ */
+void *config_arena_alloc(size_t size) {
+	size_t start = (config_arena_used + 15) & ~(size_t) 15;
+	if (start + size > CONFIG_ARENA_SIZE) return NULL;
+	config_arena_used = start + size;
+	return config_arena + start;
+}
+
+/** 
+ * This function is the deallocator of cJSON; the arena is only reset as a whole.
+ */
+void config_arena_free(void *ptr) {
+	(void) ptr;
+}
+
+/** 
+ * This function parses the server's command line: `[-d] [-w workers] [-u udp_port]... [-e recv_engine] 
+ * [-t trace_dir] [preprobing_port]`. With `-w`, the UDP packet trains are received by that many worker threads instead 
+ * of the main thread. Every `-u` port is opened at startup with the receive engine of `-e`. With `-d`, 
+ * the server runs as a daemon that serves the ports opened at startup only (DEFAULT_UDP_DST_PORT if 
+ * no `-u` is given). With `-t`, the arrival of every packet is traced and written to `trace_dir`.
  * @param argc The number of command-line arguments.
  * @param argv An array of command-line arguments.
- * @return The preprobing port of server.
+ * @param options Set to the options of the server.
+ * @return void. Exits the program if the command line is invalid.
  */
-uint16_t parse_preprobing_port(int argc, char* argv[]) {
-	if (argc < 2) return 7777;
-	return atoi(argv[1]);
+void parse_server_options(int argc, char* argv[], struct server_options *options) {
+	memset(options, 0, sizeof(struct server_options));
+	options->preprobing_port = DEFAULT_SERVER_PORT_PREPROBING;
+	char *recv_engine = DEFAULT_RECV_ENGINE;
+	int opt;
+	while ((opt = getopt(argc, argv, "dw:u:e:t:")) != -1) {
+		if (opt == 'd') {
+			options->daemon = 1;
+		} else if (opt == 'w' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_RECV_WORKERS) {
+			options->num_workers = atoi(optarg);
+		} else if (opt == 'u' && atoi(optarg) >= 1 && atoi(optarg) <= 65535 && options->num_udp_ports < MAX_UDP_PORTS) {
+			options->udp_ports[options->num_udp_ports++] = atoi(optarg);
+		} else if (opt == 'e') {
+			recv_engine = optarg;
+		} else if (opt == 't') {
+			// the daemon changes its directory to /
+			options->trace_dir = realpath(optarg, NULL);
+			if (options->trace_dir == NULL) {
+				perror("Invalid trace directory");
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			printf("Usage: %s [-d] [-w workers (1 to %d)] [-u udp_port]... [-e recvmmsg|io_uring] [-t trace_dir] "
+				"[server_port_preprobing]\n", 
+				argv[0], MAX_RECV_WORKERS);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind < argc) options->preprobing_port = atoi(argv[optind]);
+
+	if (strcmp(recv_engine, "recvmmsg") == 0) {
+		options->recv_engine = RECV_ENGINE_RECVMMSG;
+	} else if (strcmp(recv_engine, "io_uring") == 0) {
+		options->recv_engine = RECV_ENGINE_IO_URING;
+	} else {
+		printf("-e is not set correctly. \n");
+		exit(EXIT_FAILURE);
+	}
+	if (options->daemon && options->num_udp_ports == 0) {
+		options->udp_ports[options->num_udp_ports++] = DEFAULT_UDP_DST_PORT;
+	}
 }
 
 /** 
@@ -29,10 +99,11 @@ uint16_t parse_preprobing_port(int argc, char* argv[]) {
  * @param buffer A buffer where the contents of the configuration file will be stored temporarily.
  * @param configs A pointer to the `configs` structure.
  * 
- * @return void. This function modifies the `configs` structure based on the parsed configuration data.
+ * @return 0 on success, or -1 if the configurations are invalid. Only the session that sent them is dropped.
  */
-void parse_configs(char *buffer, struct configurations *configs) {
-	// parse the JSON data 
+int parse_configs(char *buffer, struct configurations *configs) {
+	// parse the JSON data, in the arena emptied by the previous session
+	config_arena_used = 0;
 	cJSON *json = cJSON_Parse(buffer); 
 	if (json == NULL) { 
 		const char *error_ptr = cJSON_GetErrorPtr(); 
@@ -40,31 +111,17 @@ void parse_configs(char *buffer, struct configurations *configs) {
 	    	 printf("Error when parsing json str: %s\n", error_ptr); 
 	    } 
 	    cJSON_Delete(json); 
-	    exit(1); 
+	    return -1; 
 	}
 	
 	// access the JSON data 
-	cJSON *name = cJSON_GetObjectItemCaseSensitive(json,"server_port_postprobing"); 
-	if (cJSON_IsNumber(name)) { 
-		configs->server_port_postprobing = name->valueint;
-	} else {
-		configs->server_port_postprobing = DEFAULT_SERVER_PORT_POSTPROBING;
-	}
-
-	name = cJSON_GetObjectItemCaseSensitive(json,"udp_dst_port"); 
+	cJSON *name = cJSON_GetObjectItemCaseSensitive(json,"udp_dst_port"); 
 	if (cJSON_IsNumber(name)) { 
 		configs->udp_dst_port = name->valueint;
 	} else {
 		configs->udp_dst_port = DEFAULT_UDP_DST_PORT;
 	}
 	
-	name = cJSON_GetObjectItemCaseSensitive(json,"udp_head_bytes"); 
-	if (cJSON_IsString(name) && (name->valuestring != NULL)) { 
-		memcpy(configs->udp_head_bytes, name->valuestring, FIX_DATA_LEN);
-	} else {
-		memcpy(configs->udp_head_bytes, DEFAULT_UDP_HEAD_BYTES, FIX_DATA_LEN);
-	}
-
 	name = cJSON_GetObjectItemCaseSensitive(json,"l");
 	if (cJSON_IsNumber(name)) {
 		configs->l = name->valueint;
@@ -79,37 +136,105 @@ void parse_configs(char *buffer, struct configurations *configs) {
 		configs->n = DEFAULT_N;
 	}
 	
+	name = cJSON_GetObjectItemCaseSensitive(json,"gamma");
+	if (cJSON_IsNumber(name)) {
+		configs->gamma = name->valueint;
+	} else {
+		configs->gamma = DEFAULT_GAMMA;
+	}
+
 	name = cJSON_GetObjectItemCaseSensitive(json,"tau");
 	if (cJSON_IsNumber(name)) {
 		configs->tau = name->valueint;
 	} else {
 		configs->tau = DEFAULT_TAU;
 	}
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"session_id");
+	if (cJSON_IsNumber(name)) {
+		configs->session_id = (uint32_t) name->valuedouble;
+	} else {
+		configs->session_id = 0;
+	}
+
+	if (parse_entropy_levels(json, configs->entropy_levels, &configs->num_trains) == -1) {
+		cJSON_Delete(json);
+		return -1;
+	}
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"calibrate");
+	configs->baseline_trains = (cJSON_IsBool(name) ? cJSON_IsTrue(name) : cJSON_IsNumber(name) ? name->valueint : DEFAULT_CALIBRATE) ? CALIBRATION_TRAINS : 0;
+	if (configs->baseline_trains > 0) {
+		if (configs->num_trains + CALIBRATION_TRAINS > MAX_TRAINS) {
+			printf("entropy_levels can have at most %d levels with calibrate. \n", MAX_TRAINS - CALIBRATION_TRAINS);
+			cJSON_Delete(json);
+			return -1;
+		}
+		// the baseline trains go first, so the threshold is known before the trains under test arrive
+		memmove(configs->entropy_levels + CALIBRATION_TRAINS, configs->entropy_levels, configs->num_trains);
+		memset(configs->entropy_levels, ENTROPY_LOW, CALIBRATION_TRAINS);
+		configs->num_trains += CALIBRATION_TRAINS;
+	}
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"interleave");
+	if (cJSON_IsNumber(name) && name->valueint >= 0) {
+		configs->interleave = name->valueint;
+	} else {
+		configs->interleave = DEFAULT_INTERLEAVE;
+	}
+
+	// the departures of interleaved trains are not timestamped, their dispersion is measured by busy time
+	name = cJSON_GetObjectItemCaseSensitive(json,"tx_timestamps");
+	configs->tx_timestamps = (cJSON_IsBool(name) ? cJSON_IsTrue(name) : cJSON_IsNumber(name) ? name->valueint : DEFAULT_TX_TIMESTAMPS) && 
+		configs->interleave == 0;
+
+	// the client writes the structured result to its report file, the server only sends it if there is one
+	name = cJSON_GetObjectItemCaseSensitive(json,"report_file");
+	configs->report = strlen(cJSON_IsString(name) && (name->valuestring != NULL) ? name->valuestring : DEFAULT_REPORT_FILE) > 0;
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"confidence");
+	if (cJSON_IsNumber(name)) {
+		configs->confidence = name->valuedouble;
+	} else {
+		configs->confidence = DEFAULT_CONFIDENCE;
+	}
+	if (configs->confidence != 0 && (configs->confidence <= 0.5 || configs->confidence >= 1)) {
+		printf("confidence must be 0 or between 0.5 and 1. \n");
+		cJSON_Delete(json);
+		return -1;
+	}
+
+	name = cJSON_GetObjectItemCaseSensitive(json,"recv_engine");
+	char *recv_engine = cJSON_IsString(name) && (name->valuestring != NULL) ? name->valuestring : DEFAULT_RECV_ENGINE;
+	if (strcmp(recv_engine, "recvmmsg") == 0) {
+		configs->recv_engine = RECV_ENGINE_RECVMMSG;
+	} else if (strcmp(recv_engine, "io_uring") == 0) {
+		configs->recv_engine = RECV_ENGINE_IO_URING;
+	} else {
+		printf("recv_engine is not set correctly. \n");
+		cJSON_Delete(json);
+		return -1;
+	}
 	  
 	// delete the JSON object 
 	cJSON_Delete(json);  
+	return 0;
 }
 
 /** 
- * This function checks if the configuration file is provided, then parses the configuration 
- * file, and execute three detection processes: preprocessing, probing, and postprobing.
+ * This function parses the server's command line, then serves detection sessions until the 
+ * server is killed. Each session goes through preprobing, probing, and postprobing.
  * 
  * @param argc The number of command-line arguments.
  * @param argv An array of command-line arguments.
- * @return EXIT_SUCCESS on successful completion, or EXIT_FAILURE if an error occurs.
+ * @return Never returns on success; the program exits with EXIT_FAILURE if the server cannot start.
  */
 int main(int argc, char* argv[]) {
-	struct configurations configs;
-	uint16_t preprobing_port = parse_preprobing_port(argc, argv);
-	char buffer[BUFFER_SIZE];
-	serve_pre_probe(preprobing_port, buffer, BUFFER_SIZE - 1);
-	parse_configs(buffer, &configs);
-	
-	int detect_result = 0;
-	serve_probe(&configs, &detect_result);
+	struct server_options options;
+	parse_server_options(argc, argv, &options);
 
-	serve_post_probe(configs.server_port_postprobing, detect_result);
-
-	return 0;
+	cJSON_Hooks hooks = { config_arena_alloc, config_arena_free };
+	cJSON_InitHooks(&hooks);
+	serve_sessions(&options);
+	return EXIT_SUCCESS;
 }
-
@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "control_channel.h"
+
+/** 
+ * This function sends `len` bytes on a TCP socket, continuing after partial sends.
+ * 
+ * @return 0 on success, or -1 if sending failed.
+ */
+int send_all(int sock, const void *data, size_t len) {
+	const char *p = data;
+	while (len > 0) {
+		ssize_t count = send(sock, p, len, MSG_NOSIGNAL);
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += count;
+		len -= count;
+	}
+	return 0;
+}
+
+/** 
+ * This function receives exactly `len` bytes from a TCP socket.
+ * 
+ * @return 0 on success, or -1 if receiving failed or the peer closed the connection.
+ */
+int recv_all(int sock, void *data, size_t len) {
+	char *p = data;
+	while (len > 0) {
+		ssize_t count = recv(sock, p, len, 0);
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (count == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		p += count;
+		len -= count;
+	}
+	return 0;
+}
+
+/** 
+ * This function sends one message on the control channel: a `ctrl_header` followed by the payload.
+ * 
+ * @param sock The control channel socket.
+ * @param type The type of the message (CTRL_*).
+ * @param payload The payload of the message, may be NULL if `len` is 0.
+ * @param len The length of the payload.
+ * 
+ * @return 0 on success, or -1 if sending failed.
+ */
+int send_ctrl_msg(int sock, uint8_t type, const void *payload, uint32_t len) {
+	struct ctrl_header header;
+	memset(&header, 0, sizeof(header));
+	header.type = type;
+	header.len = htonl(len);
+	if (send_all(sock, &header, CTRL_HEADER_LEN) == -1) return -1;
+	if (len > 0 && send_all(sock, payload, len) == -1) return -1;
+	return 0;
+}
+
+/** 
+ * This function receives one message from the control channel, blocking until it is complete.
+ * 
+ * @param sock The control channel socket.
+ * @param type Set to the type of the message (CTRL_*).
+ * @param buf The buffer the payload is stored in.
+ * @param buf_len The size of the buffer.
+ * @param len Set to the length of the payload.
+ * 
+ * @return 0 on success, or -1 if receiving failed, the peer closed the connection or the payload 
+ *         does not fit in the buffer.
+ */
+int recv_ctrl_msg(int sock, uint8_t *type, void *buf, uint32_t buf_len, uint32_t *len) {
+	struct ctrl_header header;
+	if (recv_all(sock, &header, CTRL_HEADER_LEN) == -1) return -1;
+	*type = header.type;
+	*len = ntohl(header.len);
+	if (*len > buf_len) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (*len > 0 && recv_all(sock, buf, *len) == -1) return -1;
+	return 0;
+}
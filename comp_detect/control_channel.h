@@ -0,0 +1,47 @@
+#ifndef CONTROL_CHANNEL_H
+#define CONTROL_CHANNEL_H
+
+#include <stdint.h>
+
+/** Types of the messages exchanged over the control channel */
+#define CTRL_CONFIG 1 // client to server: the JSON configurations of the session
+#define CTRL_READY 2 // server to client: the receiver is armed, the trains can be sent
+#define CTRL_RESULT 3 // server to client: the detection result message
+#define CTRL_STOP 4 // server to client: the sequential test decided, the rest of the trains need not be sent
+#define CTRL_TX_REPORT 5 // client to server: the departure dispersion of a train, from its TX timestamps (struct tx_report)
+#define CTRL_REPORT 6 // server to client: the detection result as a JSON document, after CTRL_RESULT if the client asked for it
+
+/** the largest payload of a CTRL_REPORT message, enough for every gap histogram bucket of MAX_TRAINS trains */
+#define REPORT_BUF_SIZE (512 * 1024)
+
+/** Clocks the departure dispersion of a CTRL_TX_REPORT is measured with */
+#define TX_CLOCK_NONE 0 // the TX timestamps of the first and the last packet could not be read
+#define TX_CLOCK_SOFTWARE 1 // taken by the kernel when the packets were handed to the driver
+#define TX_CLOCK_HARDWARE 2 // taken by the NIC when the packets left it
+
+/** 
+ * Header in front of every message on the control channel, the TCP connection the client opens 
+ * in pre-probing phase and keeps until the result is received. All fields are in network byte order.
+ */
+struct ctrl_header {
+	uint8_t type; // one of the CTRL_* types
+	uint8_t reserved[3];
+	uint32_t len; // the length of the payload following the header
+};
+
+#define CTRL_HEADER_LEN sizeof(struct ctrl_header)
+
+/** Payload of a CTRL_TX_REPORT message, in network byte order */
+struct tx_report {
+	uint16_t train_id;
+	uint8_t clock; // the TX_CLOCK_* the departures were timestamped with
+	uint8_t reserved;
+	uint32_t dispersion_sec; // the time between the departures of the first and the last packet of the train
+	uint32_t dispersion_nsec;
+};
+
+int send_ctrl_msg(int, uint8_t, const void *, uint32_t);
+
+int recv_ctrl_msg(int, uint8_t *, void *, uint32_t, uint32_t *);
+
+#endif
@@ -3,17 +3,25 @@
 
 // Default configuration values
 #define DEFAULT_SERVER_PORT_PREPROBING 7777
-#define DEFAULT_SERVER_PORT_POSTPROBING 6666
 #define DEFAULT_CLIENT_PORT_SYN 1234
 #define DEFAULT_SERVER_PORT_HEAD_SYN 9999
 #define DEFAULT_SERVER_PORT_TAIL_SYN 8888
 #define DEFAULT_UDP_SRC_PORT 9876
 #define DEFAULT_UDP_DST_PORT 8765
-#define DEFAULT_UDP_HEAD_BYTES "1234567890"
 #define DEFAULT_L 1000
 #define DEFAULT_N 6000
 #define DEFAULT_GAMMA 15
 #define DEFAULT_TAU 100
 #define DEFAULT_TTL 255
+#define DEFAULT_SEND_MODE "mmsg"
+#define DEFAULT_BATCH_SIZE 64
+#define DEFAULT_RATE_PPS 0
+#define DEFAULT_PACING "bucket"
+#define DEFAULT_INTERLEAVE 0
+#define DEFAULT_RECV_ENGINE "recvmmsg"
+#define DEFAULT_CONFIDENCE 0
+#define DEFAULT_CALIBRATE 0
+#define DEFAULT_TX_TIMESTAMPS 0
+#define DEFAULT_REPORT_FILE ""
 
 #endif
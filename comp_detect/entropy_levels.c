@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "entropy_levels.h"
+
+/** 
+ * This function reads the `entropy_levels` config, shared by the client and the server so both 
+ * agree on the trains of a session: one train per entry, a Number from ENTROPY_LOW to ENTROPY_HIGH 
+ * or "text" for ENTROPY_TEXT. Without the config, a low and a high entropy train are sent.
+ * 
+ * @param json The JSON object of the configurations.
+ * @param levels The array of MAX_TRAINS entries the entropy level of each train is stored in.
+ * @param num_trains Set to the number of trains.
+ * @return 0 on success, or -1 if the config is not set correctly, which is reported.
+ */
+int parse_entropy_levels(const cJSON *json, uint8_t *levels, uint16_t *num_trains) {
+	cJSON *name = cJSON_GetObjectItemCaseSensitive(json,"entropy_levels");
+	if (!cJSON_IsArray(name)) {
+		// a low and a high entropy train
+		*num_trains = 2;
+		levels[0] = ENTROPY_LOW;
+		levels[1] = ENTROPY_HIGH;
+		return 0;
+	}
+
+	*num_trains = 0;
+	cJSON *level;
+	cJSON_ArrayForEach(level, name) {
+		if (*num_trains == MAX_TRAINS) {
+			printf("entropy_levels can have at most %d levels. \n", MAX_TRAINS);
+			return -1;
+		}
+		if (cJSON_IsNumber(level) && level->valueint >= ENTROPY_LOW && level->valueint <= ENTROPY_HIGH) {
+			levels[(*num_trains)++] = level->valueint;
+		} else if (cJSON_IsString(level) && strcmp(level->valuestring, "text") == 0) {
+			levels[(*num_trains)++] = ENTROPY_TEXT;
+		} else {
+			printf("entropy_levels is not set correctly. \n");
+			return -1;
+		}
+	}
+	if (*num_trains < 2) {
+		printf("entropy_levels needs at least two levels. \n");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef ENTROPY_LEVELS_H
+#define ENTROPY_LEVELS_H
+
+#include <stdint.h>
+#include <cjson/cJSON.h>
+#include "probe_header.h"
+
+int parse_entropy_levels(const cJSON *, uint8_t *, uint16_t *);
+
+#endif
@@ -2,76 +2,234 @@
 #include <stdio.h>
 #include <string.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stddef.h>
 #include <unistd.h>
-#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 
 #include "payload_generator.h"
 
+/** Four xoshiro256++ generators run side by side, one per 64-bit lane of a 256-bit vector */
+typedef uint64_t rng_lanes __attribute__((vector_size(RNG_LANES * sizeof(uint64_t))));
+
+/** The generator state, seeded once per thread from the kernel */
+static __thread rng_lanes rng_state[4];
+static __thread int rng_seeded = 0;
+
+/** Rotates every lane of `x` left by `k` bits */
+#define ROTL_LANES(x, k) (((x) << (k)) | ((x) >> (64 - (k))))
+
+/** 
+ * This function advances all the lanes of the generator by one step and stores their output,
+ * RNG_LANES * 8 random bytes, in `out`. The compiler maps the lane-wise operations to SIMD 
+ * instructions.
+ */
+static inline void next_lanes(rng_lanes *out) {
+	*out = ROTL_LANES(rng_state[0] + rng_state[3], 23) + rng_state[0];
+	rng_lanes t = rng_state[1] << 17;
+	rng_state[2] ^= rng_state[0];
+	rng_state[3] ^= rng_state[1];
+	rng_state[1] ^= rng_state[2];
+	rng_state[0] ^= rng_state[3];
+	rng_state[2] ^= t;
+	rng_state[3] = ROTL_LANES(rng_state[3], 45);
+}
+
+/** 
+ * This function seeds every lane of the generator from `getrandom`, the kernel CSPRNG is only 
+ * read this once. An all-zero lane would get stuck at zero, so such a seed is drawn again.
+ */
+static void seed_rng(void) {
+	do {
+		if (getrandom(rng_state, sizeof(rng_state), 0) != sizeof(rng_state)) {
+			perror("Failed to seed random generator");
+			exit(EXIT_FAILURE);
+		}
+	} while (!(rng_state[0][0] | rng_state[1][0] | rng_state[2][0] | rng_state[3][0]) ||
+		!(rng_state[0][1] | rng_state[1][1] | rng_state[2][1] | rng_state[3][1]) ||
+		!(rng_state[0][2] | rng_state[1][2] | rng_state[2][2] | rng_state[3][2]) ||
+		!(rng_state[0][3] | rng_state[1][3] | rng_state[2][3] | rng_state[3][3]));
+	rng_seeded = 1;
+}
+
 /** 
-* This function opens "/dev/urandom", reads the requested number of random bytes,
-* and writes them to the provided buffer.
+* This function fills the provided buffer with the requested number of random bytes from an 
+* in-process xoshiro256++ generator running RNG_LANES lanes in parallel, seeded once per thread 
+* from `getrandom`. The output only needs to be incompressible, not cryptographically secure, 
+* so bulk fills of large payload arenas run at memory speed instead of reading /dev/urandom.
 * 
 * @param ptr The buffer to store the generated random bytes.
 * @param size The number of random bytes to generate.
 */
-void generate_random_bytes(unsigned char *ptr, int size) {
-	int randomData = open("/dev/urandom", O_RDONLY);
-	if (randomData < 0) {
-		perror("Cannot open /dev/urandom");
-		exit(EXIT_FAILURE);
+void generate_random_bytes(unsigned char *ptr, size_t size) {
+	if (!rng_seeded) seed_rng();
+
+	rng_lanes out;
+	size_t i = 0;
+	for (; i + sizeof(rng_lanes) <= size; i += sizeof(rng_lanes)) {
+		next_lanes(&out);
+		memcpy(ptr + i, &out, sizeof(rng_lanes));
 	}
+	if (i < size) {
+		next_lanes(&out);
+		memcpy(ptr + i, &out, size - i);
+	}
+}
 
-	/** "/dev/urandom" can return fewer bytes than you've asked for when there is not 
-	enough bytes. Solution: Keep reading until the requested size is received. */
-	size_t randomDataLen = 0;
-	while (randomDataLen < size) {
-		ssize_t read_bytes = read(randomData, ptr + randomDataLen, size - randomDataLen);
-		if (read_bytes < 0) {
-			perror("Failed to read in random bytes");
-			close(randomData);
-			exit(EXIT_FAILURE);
+/** 
+ * This function fills the buffer with text-like content: words drawn at random from a small 
+ * dictionary, separated by spaces and sentence ends. Like natural text, it compresses well 
+ * but not as well as a constant fill.
+ * 
+ * @param ptr The buffer to fill.
+ * @param size The number of bytes to fill.
+ */
+void generate_text_bytes(unsigned char *ptr, size_t size) {
+	static const char *words[] = {
+		"the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with", "be", 
+		"by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", 
+		"have", "an", "had", "they", "you", "were", "their", "one", "all", "we", "can", "her", 
+		"has", "there", "been", "if", "more", "when", "will", "would", "who", "so", "no", "network", 
+		"packet", "compression", "link", "probe", "server", "client", "train", "data", "time", 
+		"measure", "path", "queue", "rate", "delay", "entropy"
+	};
+	int num_words = sizeof(words) / sizeof(words[0]);
+
+	unsigned char choices[256];
+	size_t next_choice = sizeof(choices);
+	size_t i = 0;
+	while (i < size) {
+		if (next_choice == sizeof(choices)) {
+			generate_random_bytes(choices, sizeof(choices));
+			next_choice = 0;
 		}
-		randomDataLen += read_bytes;
+		unsigned char choice = choices[next_choice++];
+		const char *word = words[choice % num_words];
+		for (size_t k = 0; word[k] != '\0' && i < size; k++) ptr[i++] = word[k];
+		if (i < size) ptr[i++] = choice < 16 ? '.' : ' ';
 	}
-
-	close(randomData);
 }
 
 /**
- * This function creates a buffer of the specified size, fills it with random bytes
- * or zeroes depending on the value of `entropy_high`. The first 2 bytes are reserved
- * for the packet ID, which will be filled by the `fill_packet_id` function.
+ * This function creates a buffer of the specified size and fills it with content of the 
+ * requested entropy level. For a level between 0 and 100, every GRADE_BLOCK_SIZE byte block 
+ * starts with `entropy_level` percent random bytes followed by zeroes, so compressors shrink 
+ * the payload to roughly that percentage. ENTROPY_LOW is all zeroes, ENTROPY_HIGH is fully 
+ * random, and ENTROPY_TEXT is text-like content. The first PROBE_HEADER_LEN bytes are 
+ * reserved for the probe header, which will be filled by the `fill_probe_header` and 
+ * `fill_packet_id` functions.
  * 
- * @param size The total size of the payload (including the 2-byte packet ID).
- * @param entropy_high indicating whether to fill the payload with random data (1) or zeroes (0).
+ * @param size The total size of the payload (including the probe header).
+ * @param entropy_level The entropy level of the payload (0 to 100, or ENTROPY_TEXT).
  * @return A pointer to the generated payload.
  */
-unsigned char * generate_payload(int size, int entropy_high) {
+unsigned char * generate_payload(int size, int entropy_level) {
 	unsigned char *data_ptr = malloc(size);
 	if (data_ptr == NULL) {
 		perror("Failed to allocate memory for UDP packet data");
 		exit(EXIT_FAILURE);
 	}
+	memset(data_ptr, 0, size);
 	
-	data_ptr += sizeof(uint16_t); // move ptr to the start of low/high entropy data
+	unsigned char *data = data_ptr + PROBE_HEADER_LEN; // the start of the payload content after the probe header
+	size_t data_len = size - PROBE_HEADER_LEN;
 
-	if (entropy_high) {
-		generate_random_bytes(data_ptr, size - sizeof(uint16_t)); //the first 2 bytes (16 bits) are reserved for packet ID
-	} else {
-		memset(data_ptr, 0, size - sizeof(uint16_t));
+	if (entropy_level == ENTROPY_TEXT) {
+		generate_text_bytes(data, data_len);
+	} else if (entropy_level >= ENTROPY_HIGH) {
+		generate_random_bytes(data, data_len);
+	} else if (entropy_level > ENTROPY_LOW) {
+		size_t random_len = (GRADE_BLOCK_SIZE * entropy_level + 50) / 100;
+		for (size_t i = 0; i < data_len; i += GRADE_BLOCK_SIZE) {
+			size_t len = data_len - i < random_len ? data_len - i : random_len;
+			generate_random_bytes(data + i, len);
+		}
 	}
-	return data_ptr - sizeof(uint16_t);
+	return data_ptr;
+}
+
+/**
+ * This function writes the probe header of a packet train at the beginning of the provided 
+ * buffer. The sequence number and the TX timestamp are left at 0, and are set per packet by 
+ * `fill_packet_id` and `fill_tx_timestamp`.
+ * 
+ * @param data_ptr The buffer where the probe header will be written.
+ * @param session_id The ID of the client session (in host byte order).
+ * @param train_id The index of the train within the session (in host byte order).
+ * @param entropy The entropy level of the payload (ENTROPY_*).
+ */
+void fill_probe_header(unsigned char *data_ptr, uint32_t session_id, uint16_t train_id, uint8_t entropy) {
+	struct probe_header header;
+	header.version = PROBE_VERSION;
+	header.entropy = entropy;
+	header.train_id = htons(train_id);
+	header.session_id = htonl(session_id);
+	header.seq = 0;
+	header.tx_sec = 0;
+	header.tx_nsec = 0;
+	memcpy(data_ptr, &header, PROBE_HEADER_LEN);
 }
 
 /**
  * This function takes a packet ID, converts it to network byte order (Big Endian),
- * and stores it at the beginning of the provided buffer. The size of the packet ID
- * is 2 bytes (16 bits).
+ * and stores it in the sequence number field of the probe header at the beginning 
+ * of the provided buffer. The size of the packet ID is 4 bytes (32 bits).
  * 
  * @param data_ptr The buffer where the packet ID will be written.
  * @param packet_id The packet ID to be written (in host byte order).
  */
-void fill_packet_id(unsigned char *data_ptr, uint16_t packet_id) {
-	uint16_t network_packet_id = htons(packet_id);
-	memcpy(data_ptr, &network_packet_id, sizeof(network_packet_id));
+void fill_packet_id(unsigned char *data_ptr, uint32_t packet_id) {
+	uint32_t network_packet_id = htonl(packet_id);
+	memcpy(data_ptr + offsetof(struct probe_header, seq), &network_packet_id, sizeof(network_packet_id));
+}
+
+/**
+ * This function stores the time a packet is handed to the kernel in the TX timestamp fields of the 
+ * probe header at the beginning of the provided buffer, in network byte order, so the receiver 
+ * can follow the one-way delay of every packet.
+ * 
+ * @param data_ptr The buffer where the TX timestamp will be written.
+ * @param ts The send time (CLOCK_REALTIME).
+ */
+void fill_tx_timestamp(unsigned char *data_ptr, struct timespec *ts) {
+	uint32_t network_tx[2] = { htonl((uint32_t) ts->tv_sec), htonl((uint32_t) ts->tv_nsec) };
+	memcpy(data_ptr + offsetof(struct probe_header, tx_sec), network_tx, sizeof(network_tx));
+}
+
+/**
+ * This function lays out `entries` copies of `payload` back to back in one page-aligned arena,
+ * and fills the packet ID of the i-th copy with i. The arena is mapped with `mmap`, so it 
+ * starts on a page boundary and can be handed to the kernel for zero-copy sending.
+ * 
+ * @param payload The payload template of size `size`.
+ * @param size The size of each payload in the arena.
+ * @param entries The number of payloads in the arena.
+ * @param arena_len Set to the length of the mapped arena, needed to free it.
+ * @return A pointer to the first payload of the arena.
+ */
+unsigned char * build_payload_ring(unsigned char *payload, uint32_t size, uint32_t entries, size_t *arena_len) {
+	long page_size = sysconf(_SC_PAGESIZE);
+	*arena_len = ((size_t) size * entries + page_size - 1) / page_size * page_size;
+	unsigned char *arena = mmap(NULL, *arena_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (arena == MAP_FAILED) {
+		perror("Failed to map memory for the payload ring");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < entries; i++) {
+		memcpy(arena + (size_t) i * size, payload, size);
+		fill_packet_id(arena + (size_t) i * size, i);
+	}
+	return arena;
+}
+
+/**
+ * This function releases a payload arena built by `build_payload_ring`.
+ * 
+ * @param arena The arena returned by `build_payload_ring`.
+ * @param arena_len The length of the arena returned by `build_payload_ring`.
+ */
+void free_payload_ring(unsigned char *arena, size_t arena_len) {
+	munmap(arena, arena_len);
 }
@@ -1,7 +1,25 @@
 #include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "probe_header.h"
 
-void generate_random_bytes(unsigned char *, int);
+/** Number of generator lanes run in parallel by `generate_random_bytes` */
+#define RNG_LANES 4
+/** Granularity at which graded entropy payloads mix random bytes and zeroes */
+#define GRADE_BLOCK_SIZE 64
+
+void generate_random_bytes(unsigned char *, size_t);
+
+void generate_text_bytes(unsigned char *, size_t);
 
 unsigned char * generate_payload(int, int);
 
-void fill_packet_id(unsigned char *, uint16_t);
+void fill_probe_header(unsigned char *, uint32_t, uint16_t, uint8_t);
+
+void fill_packet_id(unsigned char *, uint32_t);
+
+void fill_tx_timestamp(unsigned char *, struct timespec *);
+
+unsigned char * build_payload_ring(unsigned char *, uint32_t, uint32_t, size_t *);
+
+void free_payload_ring(unsigned char *, size_t);
@@ -4,62 +4,131 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 #include "client.h"
-
-#define BUF_SIZE 64
+#include "control_channel.h"
 
 /** 
- * @brief Establishes a TCP connection to the server and receives the detection result.
- * 
- * This function runs the client task of post-probing phase: establishes a TCP connection to the server, 
- * and uses the `select` to block until data is available on the socket. Once data is available,
- * it receives the datat and prints the detection result.
+ * This function is the body of the control listener thread: it blocks on the control channel until 
+ * the server pushes its result. A CTRL_STOP message before the result, or the result itself, sets 
+ * the `stop` flag, so the train being sent ends early and no further train is sent.
  * 
- * @param configs A pointer to the `configurations` structure containing config params
- * @return void. This function does not return any value but exits on failure.
+ * @param arg The control listener.
+ * @return NULL.
  */
-void post_probe(struct configurations *configs) {
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (sock == -1) {
-	    perror("Socket creation failed");
-	    exit(EXIT_FAILURE);
+void *listen_control(void *arg) {
+	struct control_listener *listener = (struct control_listener *) arg;
+	uint8_t type = CTRL_STOP;
+	while (type == CTRL_STOP) {
+		if (recv_ctrl_msg(listener->ctrl_sock, &type, listener->result, RESULT_BUF_SIZE - 1, &listener->result_len) == -1 || 
+			(type != CTRL_STOP && type != CTRL_RESULT)) {
+			listener->failed = 1;
+			type = CTRL_RESULT;
+		}
+		pthread_mutex_lock(&listener->lock);
+		__atomic_store_n(&listener->stop, 1, __ATOMIC_RELAXED);
+		pthread_cond_broadcast(&listener->cond);
+		pthread_mutex_unlock(&listener->lock);
 	}
+	return NULL;
+}
 
-	struct sockaddr_in sin;
-	memset(&sin, 0, sizeof(sin));
-
-	in_addr_t server_addr = inet_addr(configs->server_ip_addr);
+/** 
+ * This function starts watching the control channel in a thread while the trains are sent, so the 
+ * server can stop them as soon as its sequential test reached a decision.
+ * 
+ * @param listener The control listener to start.
+ * @param ctrl_sock The control channel socket returned by `pre_probe`.
+ * @return void. This function exits on failure.
+ */
+void start_control_listener(struct control_listener *listener, int ctrl_sock) {
+	memset(listener, 0, sizeof(struct control_listener));
+	listener->ctrl_sock = ctrl_sock;
+	pthread_mutex_init(&listener->lock, NULL);
+	pthread_cond_init(&listener->cond, NULL);
+	if (pthread_create(&listener->thread, NULL, listen_control, listener) != 0) {
+		perror("Failed to create control listener");
+		close(ctrl_sock);
+		exit(EXIT_FAILURE);
+	}
+}
 
-	sin.sin_family = AF_INET; /* address from Internet, IP address specifically */
-	sin.sin_addr.s_addr = server_addr; /* already in network order */
-	sin.sin_port = htons(configs->server_port_postprobing); /* convert to network order */
+/** 
+ * This function waits `secs` seconds between two trains, or less if the server stops the trains.
+ * 
+ * @param listener The control listener.
+ * @param secs The time to wait in seconds.
+ * @return 1 if the server stopped the trains, 0 otherwise.
+ */
+int wait_for_stop(struct control_listener *listener, int secs) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += secs;
+	pthread_mutex_lock(&listener->lock);
+	while (!listener->stop && pthread_cond_timedwait(&listener->cond, &listener->lock, &deadline) != ETIMEDOUT) ;
+	int stop = listener->stop;
+	pthread_mutex_unlock(&listener->lock);
+	return stop;
+}
 
-	if (connect(sock, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
-		perror("Cannot connect to server");
-		close(sock);
+/** 
+ * This function receives the structured result the server sends after the result message, a JSON 
+ * document, and writes it to the report file, or prints it after the result if the file is "-".
+ * 
+ * @param configs A pointer to the `configurations` structure, with the report file.
+ * @param ctrl_sock The control channel socket.
+ * @return void. This function exits on failure.
+ */
+void receive_report(struct configurations *configs, int ctrl_sock) {
+	char *report = malloc(REPORT_BUF_SIZE);
+	if (report == NULL) {
+		perror("Failed to allocate the report buffer");
 		exit(EXIT_FAILURE);
 	}
+	uint8_t type;
+	uint32_t len;
+	if (recv_ctrl_msg(ctrl_sock, &type, report, REPORT_BUF_SIZE, &len) == -1 || type != CTRL_REPORT || len == 0) {
+		printf("Failed to receive the report from server\n");
+		exit(EXIT_FAILURE);
+	}
+	FILE *file = strcmp(configs->report_file, "-") == 0 ? stdout : fopen(configs->report_file, "w");
+	if (file == NULL) {
+		perror("Failed to open the report file");
+		exit(EXIT_FAILURE);
+	}
+	if (fwrite(report, 1, len, file) != len || fputc('\n', file) == EOF || (file != stdout && fclose(file) == EOF)) {
+		perror("Failed to write the report");
+		exit(EXIT_FAILURE);
+	}
+	free(report);
+}
 
-	char buffer[BUF_SIZE];
-	fd_set read_fds;
-	// Initialize the file descriptor set to zero
-	FD_ZERO(&read_fds);
-	// Add the socket to the file descriptor set
-	FD_SET(sock, &read_fds);
-	while (1) {
-		int res = select(sock + 1, &read_fds, NULL, NULL, NULL);
-		if (res != -1) {
-			int count = recv(sock, buffer, BUF_SIZE, 0);
-			if (count == -1) {
-				perror("Failed to receive detection result from server");
-				close(sock);
-				exit(EXIT_FAILURE);
-			}
-			buffer[count] = '\0';
-			printf("%s\n", buffer); //print detection result in the console
-			break;
-		}
+/** 
+ * @brief Receives the detection result from the server over the control channel.
+ * 
+ * This function runs the client task of post-probing phase: waits until the control listener received 
+ * the CTRL_RESULT message the server pushes over the control channel opened in pre-probing phase, prints 
+ * the detection result, which is followed by the dispersion of every packet train, receives the 
+ * structured result if a report file is set, and closes the control channel.
+ * 
+ * @param configs A pointer to the `configurations` structure.
+ * @param listener The control listener started before the trains were sent.
+ * @return void. This function does not return any value but exits on failure.
+ */
+void post_probe(struct configurations *configs, struct control_listener *listener) {
+	pthread_join(listener->thread, NULL);
+	if (listener->failed) {
+		close(listener->ctrl_sock);
+		printf("Failed to receive detection result from server\n");
+		exit(EXIT_FAILURE);
+	}
+	listener->result[listener->result_len] = '\0';
+	printf("%s", listener->result); //print detection result in the console
+	if (configs->report_file[0] != '\0') {
+		fflush(stdout);
+		receive_report(configs, listener->ctrl_sock);
 	}
-	close(sock);
+	close(listener->ctrl_sock);
 }
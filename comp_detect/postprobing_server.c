@@ -1,76 +1,333 @@
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 
 #include "server.h"
+#include "control_channel.h"
 
 #define COMPRESSION_MSG "Compression detected!"
 #define NO_COMPRESSION_MSG "No compression was detected."
+#define RESULT_BUF_SIZE 4096
 
 /** 
- * This function performs server's post-probing task: creates a TCP socket, listens for 
- * incoming connections, and sends a detection result message based on the `detect` value.
- * If compression is detected (`detect`is 1), it sends `COMPRESSION_MSG`; Otherwise, 
- * it sends `NO_COMPRESSION_MSG` to the client.
+ * This function tells how many packets of a train the client sent: all `n` of them, unless the 
+ * sequential test decided and stopped the client, then those up to the highest sequence number received.
  * 
- * @param postprobing_port The port to listen for incoming connections.
- * @param detect The detection result (1 for compression, 0 for no compression) decided in probing phase.
+ * @param configs A pointer to the `configurations` structure of the session.
+ * @param train The arrival statistics of the train.
+ * @param state The progress of receiving the trains of the session, with the sequential test.
+ * @return The number of packets of the train that should have arrived.
+ */
+uint32_t expected_packets(struct configurations *configs, struct train_stats *train, struct receive_state *state) {
+	return state->verdict != SPRT_UNDECIDED ? train->next_seq : (uint32_t) configs->n;
+}
+
+/** 
+ * This function writes the detection result message into `buffer`: the verdict line, followed by
+ * one line per packet train with its entropy level, the number of received packets, its dispersion, and 
+ * the duplicates, reordering and loss runs of its sequence numbers, and the spread of its departures if 
+ * the client timestamped them. The capacity of the path for the 
+ * lowest and the highest entropy data follows, with the compression ratio they imply, and the trend 
+ * of their one-way delays, with how many standard errors their difference stands out. If the 
+ * threshold is calibrated, a line reports it along with the noise of the path, and if the sequential 
+ * test is enabled, a last line tells whether it decided, and with which confidence.
  * 
- * @return void. Exits on failure during socket creation, binding, accepting, or data sending.
+ * @param buffer The buffer the message is written to.
+ * @param buffer_len The size of the buffer.
+ * @param configs A pointer to the `configurations` structure of the session.
+ * @param trains The arrival statistics of the trains of the session.
+ * @param state The progress of receiving the trains of the session.
+ * @param detect The detection result (1 for compression, 0 for no compression).
+ * 
+ * @return The length of the message.
  */
-void serve_post_probe(uint16_t postprobing_port, int detect) {
-	// Create socket
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (sock == -1) {
-	    perror("Socket creation failed");
-	    exit(EXIT_FAILURE);
+int format_result(char *buffer, int buffer_len, struct configurations *configs, struct train_stats *trains, 
+		struct receive_state *state, int detect) {
+	int len = snprintf(buffer, buffer_len, "%s\n", detect ? COMPRESSION_MSG : NO_COMPRESSION_MSG);
+	for (int t = 0; t < configs->num_trains && len < buffer_len; t++) {
+		uint8_t level = configs->entropy_levels[t];
+		char level_str[32];
+		if (level == ENTROPY_TEXT) {
+			snprintf(level_str, sizeof(level_str), "text");
+		} else {
+			snprintf(level_str, sizeof(level_str), t < configs->baseline_trains ? "%d%% random, baseline" : "%d%% random", level);
+		}
+		struct train_stats *train = &trains[t];
+		// a train stopped by the sequential test only lost packets up to the last one that arrived
+		uint32_t expected = expected_packets(configs, train, state);
+		len += snprintf(buffer + len, buffer_len - len, "Train %d (%s): received %u/%u packets, dispersion %ld ms, "
+			"%u duplicates, %u late, %u reordered (depth %u), %u lost in %u runs (longest %u)",
+			t, level_str, train->count, configs->n, train_dispersion(configs, train), train->duplicates, train->late,
+			train->reordered, train->max_reorder, expected - train->count, train->loss_runs, train->longest_loss_run);
+		if (configs->tx_timestamps && len < buffer_len) {
+			len += snprintf(buffer + len, buffer_len - len, ", departures %.3f ms", train->departure_ns / 1e6);
+		}
+		if (len < buffer_len) len += snprintf(buffer + len, buffer_len - len, "\n");
 	}
+	int low, high;
+	find_extreme_trains(configs, &low, &high);
+	struct estimate rates[2], ratio, trends[2];
+	int estimated = 0, trended = 0;
+	for (int i = 0; i < 2 && len < buffer_len; i++) {
+		int t = i == 0 ? low : high;
+		uint32_t expected = expected_packets(configs, &trains[t], state);
+		if (estimate_capacity(configs, &trains[t], expected, &rates[i]) == -1) continue;
+		estimated++;
+		len += snprintf(buffer + len, buffer_len - len, "Capacity for %s data (train %d): %.2f Mbit/s, 95%% CI %.2f to %.2f Mbit/s\n", 
+			i == 0 ? "compressible" : "incompressible", t, rates[i].value / 1e6, rates[i].low / 1e6, rates[i].high / 1e6);
+	}
+	if (estimated == 2 && len < buffer_len) {
+		estimate_compression_ratio(&rates[0], &rates[1], &ratio);
+		len += snprintf(buffer + len, buffer_len - len, "Compression ratio: %.3f, 95%% CI %.3f to %.3f\n", 
+			ratio.value, ratio.low, ratio.high);
+	}
+	for (int i = 0; i < 2 && len < buffer_len; i++) {
+		int t = i == 0 ? low : high;
+		if (estimate_delay_trend(&trains[t], &trends[i]) == -1) continue;
+		trended++;
+		len += snprintf(buffer + len, buffer_len - len, "One-way delay trend for %s data (train %d): %+.3f us/ms, "
+			"95%% CI %+.3f to %+.3f us/ms\n", i == 0 ? "compressible" : "incompressible", t, 
+			trends[i].value * 1e3, trends[i].low * 1e3, trends[i].high * 1e3);
+	}
+	if (trended == 2 && len < buffer_len) {
+		// the standard errors of the two independent fits add up in the difference
+		double se_low = (trends[0].high - trends[0].value) / ESTIMATE_Z, se_high = (trends[1].high - trends[1].value) / ESTIMATE_Z;
+		double difference = trends[1].value - trends[0].value, se = sqrt(se_low * se_low + se_high * se_high);
+		len += snprintf(buffer + len, buffer_len - len, "One-way delay trend difference: %+.3f us/ms, %.1f standard errors\n", 
+			difference * 1e3, se > 0 ? difference / se : 0);
+	}
+	if (configs->baseline_trains > 0 && len < buffer_len) {
+		if (state->tau_ns > 0) {
+			len += snprintf(buffer + len, buffer_len - len, "Calibrated threshold: %.3f ms (path noise %.3f ms)\n", 
+				state->tau_ns / 1e6, state->noise_ns / 1e6);
+		} else {
+			len += snprintf(buffer + len, buffer_len - len, "Calibration failed: the baseline trains have fewer than %d "
+				"blocks of %d packets, the threshold is tau (%u ms)\n", SPRT_MIN_BLOCKS, SPRT_BLOCK, configs->tau);
+		}
+	}
+	if (configs->confidence > 0 && len < buffer_len) {
+		if (state->verdict != SPRT_UNDECIDED) {
+			len += snprintf(buffer + len, buffer_len - len, "Sequential test: decided after %u blocks of %d packets, "
+				"confidence %.4f\n", state->sprt_blocks, SPRT_BLOCK, 1 / (1 + exp(-fabs(state->llr))));
+		} else {
+			len += snprintf(buffer + len, buffer_len - len, "Sequential test: undecided after %u blocks, "
+				"the verdict compares the full trains\n", state->sprt_blocks);
+		}
+	}
+	return len < buffer_len ? len : buffer_len - 1;
+}
 
-	// Assign address to socket
-	struct sockaddr_in sin;
-	memset(&sin, 0, sizeof(sin));
-
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = INADDR_ANY;
-	sin.sin_port = htons(postprobing_port);
+/** 
+ * This function writes the inter-arrival gaps of a train into the structured result: their number, 
+ * the smallest and the largest gap, percentiles estimated from the gap histogram, and the non-empty 
+ * buckets of the histogram, each covering the gaps from `low_ns` up to `high_ns` (exclusive).
+ * 
+ * @param buffer The buffer the JSON object is written to.
+ * @param buffer_len The size of the buffer.
+ * @param train The arrival statistics of the train.
+ * 
+ * @return The length of the object, or `buffer_len` if it was truncated.
+ */
+int format_gap_report(char *buffer, int buffer_len, struct train_stats *train) {
+	int len = snprintf(buffer, buffer_len, "{\"count\":%u", train->count > 0 ? train->count - 1 : 0);
+	if (train->count >= 2 && len < buffer_len) {
+		len += snprintf(buffer + len, buffer_len - len, ",\"min_ns\":%ld,\"max_ns\":%ld,\"p50_ns\":%ld,\"p90_ns\":%ld,"
+			"\"p99_ns\":%ld,\"p999_ns\":%ld,\"buckets\":[", train->gap_min_ns, train->gap_max_ns, gap_percentile(train, 0.5), 
+			gap_percentile(train, 0.9), gap_percentile(train, 0.99), gap_percentile(train, 0.999));
+		const char *separator = "";
+		for (int b = 0; b < GAP_HIST_BUCKETS && len < buffer_len; b++) {
+			if (train->gap_hist[b] == 0) continue;
+			long high = b + 1 < GAP_HIST_BUCKETS ? gap_bucket_low(b + 1) : train->gap_max_ns + 1;
+			len += snprintf(buffer + len, buffer_len - len, "%s{\"low_ns\":%ld,\"high_ns\":%ld,\"count\":%u}", 
+				separator, gap_bucket_low(b), high, train->gap_hist[b]);
+			separator = ",";
+		}
+		if (len < buffer_len) len += snprintf(buffer + len, buffer_len - len, "]");
+	}
+	if (len < buffer_len) len += snprintf(buffer + len, buffer_len - len, "}");
+	return len < buffer_len ? len : buffer_len;
+}
 
-	if (bind(sock, (struct sockaddr*) &sin, sizeof(sin)) == -1) {
-		perror("Cannot bind socket to address");
-		close(sock);
-		exit(EXIT_FAILURE);
+/** 
+ * This function writes the structured result of a session into `buffer`, a JSON document for 
+ * monitoring to ingest instead of the result message: the verdict and the threshold it was reached 
+ * with, the sequential test if it is enabled, and for every train its entropy level, packet counts, 
+ * sequence anomalies, loss, dispersion (and departure spread, if the client timestamped it) and 
+ * inter-arrival gaps. It is written like the result message rather than with cJSON, whose allocator 
+ * only serves the configurations.
+ * 
+ * @param buffer The buffer the document is written to.
+ * @param buffer_len The size of the buffer.
+ * @param configs A pointer to the `configurations` structure of the session.
+ * @param trains The arrival statistics of the trains of the session.
+ * @param state The progress of receiving the trains of the session.
+ * @param detect The detection result (1 for compression, 0 for no compression).
+ * 
+ * @return The length of the document, or -1 if it does not fit in the buffer.
+ */
+int format_report(char *buffer, int buffer_len, struct configurations *configs, struct train_stats *trains, 
+		struct receive_state *state, int detect) {
+	int len = snprintf(buffer, buffer_len, "{\"session_id\":%u,\"verdict\":\"%s\",\"threshold_ns\":%.0f,\"calibrated\":%s", 
+		configs->session_id, detect ? "compression" : "no_compression", state->tau_ns > 0 ? state->tau_ns : configs->tau * 1e6, 
+		state->tau_ns > 0 ? "true" : "false");
+	if (configs->confidence > 0 && len < buffer_len) {
+		len += snprintf(buffer + len, buffer_len - len, ",\"sequential_test\":{\"decided\":%s,\"blocks\":%u,\"confidence\":%.6f}", 
+			state->verdict != SPRT_UNDECIDED ? "true" : "false", state->sprt_blocks, 1 / (1 + exp(-fabs(state->llr))));
 	}
+	if (len < buffer_len) len += snprintf(buffer + len, buffer_len - len, ",\"trains\":[");
+	for (int t = 0; t < configs->num_trains && len < buffer_len; t++) {
+		struct train_stats *train = &trains[t];
+		uint32_t expected = expected_packets(configs, train, state);
+		char entropy[8];
+		if (configs->entropy_levels[t] == ENTROPY_TEXT) {
+			snprintf(entropy, sizeof(entropy), "\"text\"");
+		} else {
+			snprintf(entropy, sizeof(entropy), "%d", configs->entropy_levels[t]);
+		}
+		len += snprintf(buffer + len, buffer_len - len, "%s{\"train\":%d,\"entropy\":%s,\"baseline\":%s,\"sent\":%u,"
+			"\"received\":%u,\"lost\":%u,\"loss_runs\":%u,\"longest_loss_run\":%u,\"duplicates\":%u,\"late\":%u,"
+			"\"reordered\":%u,\"max_reorder\":%u,\"dispersion_ns\":%ld", t > 0 ? "," : "", t, entropy, 
+			t < configs->baseline_trains ? "true" : "false", expected, train->count, expected - train->count, train->loss_runs, 
+			train->longest_loss_run, train->duplicates, train->late, train->reordered, train->max_reorder, 
+			train_dispersion_ns(configs, train));
+		if (configs->tx_timestamps && len < buffer_len) {
+			len += snprintf(buffer + len, buffer_len - len, ",\"departure_ns\":%ld", train->departure_ns);
+		}
+		if (len < buffer_len) len += snprintf(buffer + len, buffer_len - len, ",\"gaps\":");
+		if (len < buffer_len) len += format_gap_report(buffer + len, buffer_len - len, train);
+		if (len < buffer_len) len += snprintf(buffer + len, buffer_len - len, "}");
+	}
+	if (len < buffer_len) len += snprintf(buffer + len, buffer_len - len, "]}");
+	return len < buffer_len ? len : -1;
+}
 
-	// Start listening 
-	if (listen(sock, 5) == -1) {
-		perror("Cannot listen incoming connection requests");
-		close(sock);
-		exit(EXIT_FAILURE);
+/** 
+ * This function allocates the buffers of the CTRL_REPORT messages once, when the server starts.
+ * 
+ * @param server The server.
+ * @return void. Exits the program on failure.
+ */
+void setup_report_buffers(struct probe_server *server) {
+	for (int i = 0; i < REPORT_BUFFERS; i++) {
+		server->free_reports[i] = malloc(CTRL_HEADER_LEN + REPORT_BUF_SIZE);
+		if (server->free_reports[i] == NULL) {
+			perror("Failed to allocate memory for the reports");
+			exit(EXIT_FAILURE);
+		}
 	}
+	server->num_free_reports = REPORT_BUFFERS;
+}
+
+/** 
+ * This function takes a free report buffer for a session that asked for the structured result.
+ * 
+ * @param server The server.
+ * @return A buffer of CTRL_HEADER_LEN + REPORT_BUF_SIZE bytes, or NULL if all of them are being sent.
+ */
+char *acquire_report_buffer(struct probe_server *server) {
+	if (server->num_free_reports == 0) return NULL;
+	return server->free_reports[--server->num_free_reports];
+}
 
-	// Accept incoming connection - in this phase just need one connection
-	int client_sock = accept(sock, NULL, NULL); //don't need client's IP addr
-	if (client_sock == -1) {
-		perror("Failed to accept connection");
-		close(sock);
-		exit(EXIT_FAILURE);
+/** 
+ * This function gives a report buffer back once its session ended.
+ * 
+ * @param server The server.
+ * @param buffer The buffer taken by `acquire_report_buffer`.
+ */
+void release_report_buffer(struct probe_server *server, char *buffer) {
+	server->free_reports[server->num_free_reports++] = buffer;
+}
+
+/** 
+ * This function performs server's post-probing task: sends a detection result message based on the 
+ * `detect` value over the control channel, as a CTRL_RESULT message.
+ * If compression is detected (`detect`is 1), it sends `COMPRESSION_MSG`; Otherwise, 
+ * it sends `NO_COMPRESSION_MSG` to the client. The verdict is followed by the dispersion
+ * of every packet train of the session. If the client asked for it, the structured result is 
+ * written to `report` as a CTRL_REPORT message, which the caller sends as the client reads it: the 
+ * report can be far larger than the socket buffer, and a slow client must not stall the server. If 
+ * no report buffer was free, an empty report is sent right away instead.
+ * 
+ * @param ctrl_sock The control channel socket accepted in pre-probing phase.
+ * @param configs A pointer to the `configurations` structure of the session.
+ * @param trains The arrival statistics of the trains of the session.
+ * @param state The progress of receiving the trains of the session, with the sequential test.
+ * @param detect The detection result (1 for compression, 0 for no compression) decided in probing phase.
+ * @param report The buffer of the CTRL_REPORT message, or NULL if none was free.
+ * 
+ * @return The length of the CTRL_REPORT message left in `report`, 0 if there is none. A failure to 
+ * send is reported, the session ends either way.
+ */
+uint32_t serve_post_probe(int ctrl_sock, struct configurations *configs, struct train_stats *trains, 
+		struct receive_state *state, int detect, char *report) {
+	char result[RESULT_BUF_SIZE];
+	int len = format_result(result, RESULT_BUF_SIZE, configs, trains, state, detect);
+	if (send_ctrl_msg(ctrl_sock, CTRL_RESULT, result, len) == -1) {
+		perror("Failed to send detection results to client");
+		return 0;
+	}
+	if (!configs->report) return 0;
+	if (report == NULL) {
+		printf("All the report buffers are in use, session %u gets no report\n", configs->session_id);
+		// an empty report tells the client it will not get one
+		if (send_ctrl_msg(ctrl_sock, CTRL_REPORT, NULL, 0) == -1) perror("Failed to send the report to client");
+		return 0;
 	}
+	len = format_report(report + CTRL_HEADER_LEN, REPORT_BUF_SIZE, configs, trains, state, detect);
+	if (len == -1) {
+		printf("The report of session %u does not fit in %d bytes\n", configs->session_id, REPORT_BUF_SIZE);
+		len = 0;
+	}
+	struct ctrl_header header;
+	memset(&header, 0, sizeof(header));
+	header.type = CTRL_REPORT;
+	header.len = htonl(len);
+	memcpy(report, &header, CTRL_HEADER_LEN);
+	return CTRL_HEADER_LEN + len;
+}
 
-	int count;
-	if (detect) {
-		send(client_sock, COMPRESSION_MSG, strlen(COMPRESSION_MSG), 0);
-	} else {
-		send(client_sock, NO_COMPRESSION_MSG, strlen(NO_COMPRESSION_MSG), 0);
+/** 
+ * This function sends as much of the queued CTRL_REPORT message of a session as the control 
+ * channel takes without blocking.
+ * 
+ * @param s The session, whose result was sent.
+ * @return 0 if the report was sent or the rest of it has to wait for the client, -1 if sending failed.
+ */
+int flush_report(struct session *s) {
+	while (s->out_sent < s->out_len) {
+		ssize_t count = send(s->ctrl_sock, s->out + s->out_sent, s->out_len - s->out_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			perror("Failed to send the report to client");
+			return -1;
+		}
+		s->out_sent += count;
 	}
-	if (count == -1) {
-		perror("Failed to send detection results to client");
-		close(client_sock);
-		close(sock);
-		exit(EXIT_FAILURE);
+	return 0;
+}
+
+/** 
+ * This function reads and discards what the client of a session whose result was sent still has 
+ * on the control channel.
+ * 
+ * @param s The session, whose result was sent.
+ * @return 0 if the client may send more, 1 if it closed the control channel, -1 if receiving failed.
+ */
+int drain_ctrl(struct session *s) {
+	char buffer[CTRL_HEADER_LEN + sizeof(struct tx_report)];
+	while (1) {
+		ssize_t count = recv(s->ctrl_sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+		if (count > 0) continue;
+		if (count == 0) return 1;
+		if (errno == EINTR) continue;
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
 	}
-	
-	close(client_sock);
-	close(sock);
 }
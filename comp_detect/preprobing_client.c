@@ -6,19 +6,21 @@
 #include <unistd.h>
 
 #include "client.h"
+#include "control_channel.h"
 
 /** 
  * This function runs the client task of preprobing phase: creates a TCP socket, connects to the server, 
- * and sends the configuration data (stored in `buffer`) to the server. After sending the data, 
- * the socket is closed. If any errors occur during preprobing, the function prints error message
- * and exits the program.
+ * and sends the configuration data (stored in `buffer`) to the server in a CTRL_CONFIG message. The 
+ * connection is kept open as the control channel of the session: the function returns once the server 
+ * has answered with CTRL_READY, meaning it is ready to receive the UDP packet trains. If any errors 
+ * occur during preprobing, the function prints error message and exits the program.
  * 
  * @param buffer A pointer to the buffer containing the configuration data to be sent to the server.
  * @param configs A pointer to the `configurations` structure that holds the server's IP address and port.
  * 
- * @return void. This function does not return any value but exits the program on failure.
+ * @return The control channel socket. This function exits the program on failure.
  */
-void pre_probe(char* buffer, struct configurations *configs) {
+int pre_probe(char* buffer, struct configurations *configs) {
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
 	if (sock == -1) {
 	    perror("Socket creation failed");
@@ -40,13 +42,20 @@ void pre_probe(char* buffer, struct configurations *configs) {
 		exit(EXIT_FAILURE);
 	}
 	
-	int count = send(sock, buffer, strlen(buffer), 0);
-
-	if (count == -1) {
+	if (send_ctrl_msg(sock, CTRL_CONFIG, buffer, strlen(buffer)) == -1) {
 		perror("Failed to send configurations");
 		close(sock);
 		exit(EXIT_FAILURE);
 	}
 
-	close(sock);
+	// Wait until the server is ready to receive the UDP packets
+	uint8_t type;
+	uint32_t len;
+	if (recv_ctrl_msg(sock, &type, NULL, 0, &len) == -1 || type != CTRL_READY) {
+		perror("Server did not get ready for probing");
+		close(sock);
+		exit(EXIT_FAILURE);
+	}
+
+	return sock;
 }
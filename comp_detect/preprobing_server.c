@@ -3,30 +3,33 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <arpa/inet.h>
 
 #include "server.h"
+#include "control_channel.h"
 
 /** 
  * This function runs the server task of preprobing: sets up a server to listen for incoming TCP
- * connections on the specified port (`preprobing_port`). Once a connection is accepted, it receives 
- * config information from the client and stores it in the input buffer.
- * After receiving the data, it closes the client and server sockets.
+ * connections on the specified port (`preprobing_port`). The listening socket is non-blocking, so
+ * the server accepts the connections of the sessions as they come, without waiting on any of them.
  * 
  * @param preprobing_port The port on which the server will listen for incoming connections.
- * @param buffer A pointer to the buffer where the received data will be stored.
- * @param buffer_len The size of the buffer that will hold the received data.
  * 
- * @return void. This function does not return any value but exits on failure.
+ * @return The listening socket. This function exits on failure.
  */
-void serve_pre_probe(uint16_t preprobing_port, char *buffer, int buffer_len) {
+int open_preprobing_listener(uint16_t preprobing_port) {
 	// Create socket
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 	if (sock == -1) {
 	    perror("Socket creation failed");
 	    exit(EXIT_FAILURE);
 	}
 
+	// Restarting the server must not wait for the connections of the previous run to time out
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
 	// Assign address to socket
 	struct sockaddr_in sin;
 	memset(&sin, 0, sizeof(sin));
@@ -42,30 +45,52 @@ void serve_pre_probe(uint16_t preprobing_port, char *buffer, int buffer_len) {
 	}
 
 	// Start listening 
-	if (listen(sock, 5) == -1) {
+	if (listen(sock, SOMAXCONN) == -1) {
 		perror("Cannot listen incoming connection requests");
 		close(sock);
 		exit(EXIT_FAILURE);
 	}
 
-	// Accept incoming connection - in this phase just need one connection
-	int client_sock = accept(sock, NULL, NULL); //don't need client's IP addr
-	if (client_sock == -1) {
-		perror("Failed to accept connection");
-		close(sock);
-		exit(EXIT_FAILURE);
+	return sock;
+}
+
+/** 
+ * This function reads the part of the CTRL_CONFIG message of a session that has arrived on its control 
+ * channel, without blocking. Once the message is complete, the configurations are stored in the input 
+ * buffer.
+ * 
+ * @param s The session, waiting for its configurations.
+ * @param buffer A pointer to the buffer where the received configurations will be stored.
+ * @param buffer_len The size of the buffer that will hold the received configurations.
+ * 
+ * @return 1 if the configurations are complete, 0 if more data is needed, or -1 if the client closed 
+ *         the connection or did not send a valid CTRL_CONFIG message.
+ */
+int receive_config(struct session *s, char *buffer, int buffer_len) {
+	while (1) {
+		int count = recv(s->ctrl_sock, s->ctrl_buf + s->ctrl_len, sizeof(s->ctrl_buf) - s->ctrl_len, MSG_DONTWAIT);
+		if (count == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR) continue;
+			perror("Failed to receive configurations");
+			return -1;
+		}
+		if (count == 0) return -1; // the client closed the connection
+		s->ctrl_len += count;
+		if (s->ctrl_len == sizeof(s->ctrl_buf)) break;
 	}
+	if (s->ctrl_len < CTRL_HEADER_LEN) return 0;
 
-	int count = recv(client_sock, buffer, buffer_len, 0);
-	if (count == -1) {
-		perror("Failed to receive");
-		close(client_sock);
-		close(sock);
-		exit(EXIT_FAILURE);
+	struct ctrl_header header;
+	memcpy(&header, s->ctrl_buf, CTRL_HEADER_LEN);
+	uint32_t len = ntohl(header.len);
+	if (header.type != CTRL_CONFIG || len >= (uint32_t) buffer_len) {
+		printf("Invalid configurations message from client\n");
+		return -1;
 	}
-	buffer[count] = '\0';
-	//printf("The server received %s\n", buffer); //to be deleted
+	if (s->ctrl_len < CTRL_HEADER_LEN + len) return 0;
 
-	close(client_sock);
-	close(sock);
+	memcpy(buffer, s->ctrl_buf + CTRL_HEADER_LEN, len);
+	buffer[len] = '\0';
+	return 1;
 }
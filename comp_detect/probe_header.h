@@ -0,0 +1,34 @@
+#ifndef PROBE_HEADER_H
+#define PROBE_HEADER_H
+
+#include <stdint.h>
+
+#define PROBE_VERSION 2
+/** Upper bound of the packet trains sent in one session */
+#define MAX_TRAINS 16
+/** The baseline trains sent first at the lowest entropy level when the threshold is calibrated */
+#define CALIBRATION_TRAINS 2
+
+/** Entropy levels of a payload: 0 to 100 is the percentage of random content */
+#define ENTROPY_LOW 0
+#define ENTROPY_HIGH 100
+#define ENTROPY_TEXT 255 // structured, text-like content
+
+/** 
+ * Fixed layout header at the start of every UDP payload of a packet train. All the fields 
+ * are in network byte order, so the receiver can tell the session, train and position of 
+ * a packet without looking at the rest of the payload, and when it left the sender.
+ */
+struct probe_header {
+	uint8_t version; // PROBE_VERSION
+	uint8_t entropy; // the entropy level of the payload (ENTROPY_*)
+	uint16_t train_id; // the index of the train within the session
+	uint32_t session_id; // identifies the client session the train belongs to
+	uint32_t seq; // the sequence number of the packet within its train
+	uint32_t tx_sec; // the time the sender handed the packet to the kernel (CLOCK_REALTIME), seconds
+	uint32_t tx_nsec; // and nanoseconds
+};
+
+#define PROBE_HEADER_LEN sizeof(struct probe_header)
+
+#endif
@@ -8,6 +8,8 @@
 
 #include "client.h"
 #include "payload_generator.h"
+#include "train_sender.h"
+#include "control_channel.h"
 
 /**
  * This function binds the provided socket descriptor to the specified port.
@@ -41,17 +43,61 @@ void set_df(int fd) {
 	}
 }
 
+/** 
+ * This function sends the departure dispersion of a train to the server as a CTRL_TX_REPORT message: 
+ * the time between the TX timestamps of its first and its last packet, taken by the NIC if it 
+ * timestamped both, otherwise by the kernel. If neither clock timestamped both packets (timestamping 
+ * unavailable, or the train was stopped early), the report says so, so the server does not wait for it. 
+ * A failure to send is reported only: the result the server sent may still be waiting to be read.
+ * 
+ * @param ctrl_sock The control channel opened in pre-probing phase.
+ * @param train_id The index of the train within the session.
+ * @param report The sender side statistics of the train, with its TX timestamps.
+ */
+void report_departures(int ctrl_sock, uint16_t train_id, struct train_report *report) {
+	struct tx_report tx;
+	memset(&tx, 0, sizeof(tx));
+	tx.train_id = htons(train_id);
+	struct timespec *first = NULL, *last = NULL;
+	if (report->hw_stamps >= 2) {
+		tx.clock = TX_CLOCK_HARDWARE;
+		first = &report->hw_first;
+		last = &report->hw_last;
+	} else if (report->sw_stamps >= 2) {
+		tx.clock = TX_CLOCK_SOFTWARE;
+		first = &report->sw_first;
+		last = &report->sw_last;
+	}
+	if (first != NULL) {
+		long dispersion_ns = (last->tv_sec - first->tv_sec) * 1000000000L + (last->tv_nsec - first->tv_nsec);
+		tx.dispersion_sec = htonl(dispersion_ns / 1000000000L);
+		tx.dispersion_nsec = htonl(dispersion_ns % 1000000000L);
+		printf("Train %d: departures spread over %.3f ms (%s TX timestamps)\n", train_id, dispersion_ns / 1e6, 
+			tx.clock == TX_CLOCK_HARDWARE ? "hardware" : "software");
+	} else {
+		printf("Train %d: the departures of the first and the last packet were not timestamped\n", train_id);
+	}
+	// the server may have decided and sent the result meanwhile, which the client still reads
+	if (send_ctrl_msg(ctrl_sock, CTRL_TX_REPORT, &tx, sizeof(tx)) == -1) perror("Failed to send the departures of a train");
+}
+
 /** 
  * This function runs the client task of probing phase, creates a UDP socket, binds it to a specified source port, 
- * and sends two series of UDP packets to a server. The payload of packets are generated using 
- * the `generate_payload` function, their first 10 bytes are determined by the configuration
- * `udp_head_bytes`, and their IDs are set. After sending the low entropy packet train, the function 
- * waits for a specified time (`gamma`) before sending the high entropy train.
+ * and sends one series of UDP packets to a server for each configured entropy level (by default a low 
+ * and a high entropy train). The payload of packets are generated using the `generate_payload` function, 
+ * they start with a probe header carrying the session ID, the train ID and the packet ID. The trains are 
+ * handed to the kernel by `send_train`. Between two packet trains, the function waits for a specified 
+ * time (`gamma`). If `interleave` is set, the trains are instead sent at once as one stream of 
+ * alternating blocks by `send_interleaved_trains`, without waiting between them. When the server 
+ * stops the trains over the control channel, the train being sent ends early and no further 
+ * train is sent. With `tx_timestamps`, the departure dispersion of every train is reported to the 
+ * server after the train, unless the server stopped the trains.
  * 
  * @param configs A pointer to the `configurations` structure containing config params
+ * @param listener The control listener watching the control channel for the server to stop the trains.
  * @return void. This function does not return any value but exits on failure.
  */
-void probe(struct configurations *configs) {
+void probe(struct configurations *configs, struct control_listener *listener) {
 	int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock == -1) {
 	    perror("Socket creation failed");
@@ -74,40 +120,66 @@ void probe(struct configurations *configs) {
 	// Set DF bit
 	set_df(sock);
 
-	unsigned char *low_entropy_payload = generate_payload(configs->l, 0);
-	unsigned char *high_entropy_payload = generate_payload(configs->l, 1);
-	// Set the first 10 bytes to data regulated by configs
-	strncpy(high_entropy_payload + sizeof(uint16_t), configs->udp_head_bytes, FIX_DATA_LEN);
-	
-	int count;
-	// Send low entropy packet train
-	for (int i = 0; i < configs->n; i++) {
-		fill_packet_id(low_entropy_payload, i);
-		count = sendto(sock, low_entropy_payload, configs->l, 0, (struct sockaddr *) &server_sin, sizeof(server_sin));
-		if (count == -1) {
-			perror("Failed to send UDP packets with low entropy data");
-			free(low_entropy_payload);
+	// the server waits for the departures of every train either way
+	int tx_timestamps = configs->tx_timestamps;
+	if (tx_timestamps && enable_tx_timestamps(sock) == -1) {
+		perror("SO_TIMESTAMPING is unavailable, the departures are not timestamped");
+		tx_timestamps = 0;
+	}
+
+	struct send_options opts = { .mode = configs->send_mode, .batch_size = configs->batch_size, 
+		.rate_pps = configs->rate_pps, .pacing = configs->pacing, .stop = &listener->stop, 
+		.tx_timestamps = tx_timestamps };
+	struct train_report report;
+	char label[32];
+
+	if (configs->interleave > 0) {
+		unsigned char *payloads[MAX_TRAINS];
+		for (int t = 0; t < configs->num_trains; t++) {
+			payloads[t] = generate_payload(configs->l, configs->entropy_levels[t]);
+			fill_probe_header(payloads[t], configs->session_id, t, configs->entropy_levels[t]);
+		}
+		int result = send_interleaved_trains(sock, &server_sin, payloads, configs->num_trains, configs->l, 
+			configs->n, configs->interleave, &opts, &report);
+		for (int t = 0; t < configs->num_trains; t++) {
+			free(payloads[t]);
+		}
+		if (result == -1) {
 			close(sock);
 			exit(EXIT_FAILURE);
 		}
+		print_train_report("Interleaved trains", &report);
+		if (__atomic_load_n(&listener->stop, __ATOMIC_RELAXED)) printf("The server stopped the trains early\n");
+		close(sock);
+		return;
 	}
-	free(low_entropy_payload); //free allocated resources
 
-	// Wait γ secs before sending the high entropy packet train
-	sleep(configs->gamma);
-	
-	// Send high entropy packet train
-	for (int i = 0; i < configs->n; i++) {
-		fill_packet_id(high_entropy_payload, i);
-		count = sendto(sock, high_entropy_payload, configs->l, 0, (struct sockaddr *) &server_sin, sizeof(server_sin));
-		if (count == -1) {
-			perror("Failed to send UDP packets with high entropy data");
-			free(high_entropy_payload);
+	for (int t = 0; t < configs->num_trains; t++) {
+		// Wait γ secs between the packet trains
+		if (t > 0 && wait_for_stop(listener, configs->gamma)) break;
+
+		uint8_t level = configs->entropy_levels[t];
+		unsigned char *payload = generate_payload(configs->l, level);
+		// Tag the packets with the session and train, the server classifies them by this header
+		fill_probe_header(payload, configs->session_id, t, level);
+
+		if (send_train(sock, &server_sin, payload, configs->l, configs->n, &opts, &report) == -1) {
+			free(payload);
 			close(sock);
 			exit(EXIT_FAILURE);
 		}
+		if (level == ENTROPY_TEXT) {
+			snprintf(label, sizeof(label), "Train %d (text)", t);
+		} else {
+			snprintf(label, sizeof(label), "Train %d (%d%% random)", t, level);
+		}
+		print_train_report(label, &report);
+		free(payload); //free allocated resources
+		// once the server stopped the trains, it has decided and no longer waits for their departures
+		if (__atomic_load_n(&listener->stop, __ATOMIC_RELAXED)) break;
+		if (configs->tx_timestamps) report_departures(listener->ctrl_sock, t, &report);
 	}
-	free(high_entropy_payload);
+	if (__atomic_load_n(&listener->stop, __ATOMIC_RELAXED)) printf("The server stopped the trains early\n");
 	
 	close(sock);
 }
@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
@@ -7,11 +9,19 @@
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <math.h>
+#include <sys/epoll.h>
 #include "server.h"
+#include "probe_header.h"
+#include "control_channel.h"
 
 /** the time that the server would spend to receive UDP packets until we consider the
 rest expected packets are lost and move to the next stage */
 #define CUTOFF_TIME 60
+/** a train is considered over once no packet arrived for IDLE_GAP_FACTOR times its mean 
+inter-arrival gap, and at least IDLE_GAP_FLOOR_MS */
+#define IDLE_GAP_FACTOR 100
+#define IDLE_GAP_FLOOR_MS 500
 
 /** 
  * This function modify the socket descriptor's flags and set it to non-blocking mode.
@@ -51,128 +61,541 @@ void increase_sys_rcvbuf_size(int fd) {
 	}
 }
 
+/** 
+ * This function asks the kernel to attach its receive timestamp (SO_TIMESTAMPNS, CLOCK_REALTIME) to 
+ * every packet read from the socket. The timestamp is taken when the packet enters the stack, so 
+ * it does not include the time the packet waits in the socket buffer or the scheduling delay of 
+ * the server.
+ * 
+ * @param fd file descriptor of the UDP socket.
+ * @return 0 on success, or -1 if the kernel does not support receive timestamps.
+ */
+int enable_rx_timestamps(int fd) {
+	int on = 1;
+	return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+}
+
+/** 
+ * This function returns the kernel receive timestamp attached to a received message.
+ * 
+ * @param msg The message header filled by `recvmsg` or `recvmmsg`.
+ * @param ts Set to the receive timestamp of the message.
+ * @return 1 if the message carries a receive timestamp, 0 otherwise.
+ */
+int rx_timestamp(struct msghdr *msg, struct timespec *ts) {
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(ts, CMSG_DATA(cm), sizeof(struct timespec));
+			return 1;
+		}
+	}
+	return 0;
+}
+
 /**
- * This function checks if a given buffer corresponds to low or high entropy data.
- * corresponds to low or high entropy data. It checks whether the buffer matches either 
- * of the data heads up to the specified length (`head_len`).
+ * This function classifies a received packet by its probe header. A packet belongs to a train 
+ * of the session if it is long enough to hold the header, carries the current PROBE_VERSION and
+ * the session's ID, and its train ID is within the trains of the session.
+ *
+ * @param buf A pointer to the buffer containing the received payload.
+ * @param len The length of the received payload.
+ * @param configs A pointer to the `configurations` structure of the session.
+ * 
+ * @return The train ID of the packet, or -1 if the packet does not belong to the session.
+ */
+int classify_packet(unsigned char *buf, int len, struct configurations *configs) {
+	if (len < (int) PROBE_HEADER_LEN) return -1;
+	struct probe_header *header = (struct probe_header *) buf;
+	if (header->version != PROBE_VERSION || ntohl(header->session_id) != configs->session_id) {
+		return -1;
+	}
+	uint16_t train_id = ntohs(header->train_id);
+	return train_id < configs->num_trains ? train_id : -1;
+}
+
+/** 
+ * This function returns the time between the first and the last received packet of a train in nanos.
+ * When the client interleaves the trains, the first and last packets of every train arrive at about 
+ * the same times, so the dispersion is instead the busy time of the train: the sum of the gaps 
+ * between a packet of the train and the packet that arrived just before it, i.e. the time the 
+ * bottleneck of the path spent on the packets of the train.
+ * 
+ * @param configs A pointer to the `configurations` structure of the session.
+ * @param train The statistics of the train.
+ * @return The dispersion of the train in nanos.
+ */
+long train_dispersion_ns(struct configurations *configs, struct train_stats *train) {
+	if (configs->interleave > 0) return train->busy_ns;
+	return (train->t_last.tv_sec - train->t_first.tv_sec) * 1000000000L + (train->t_last.tv_nsec - train->t_first.tv_nsec);
+}
+
+/** 
+ * This function returns the dispersion the path added to a train: its dispersion (see 
+ * `train_dispersion_ns`) minus the time between the departures of its first and its last packet, 
+ * if the client timestamped them, so a sender whose own qdisc or NIC spread the train out is not 
+ * mistaken for a slow path. The busy time of interleaved trains is used as it is.
+ * 
+ * @param configs A pointer to the `configurations` structure of the session.
+ * @param train The statistics of the train.
+ * @return The dispersion added by the path in nanos.
+ */
+long path_dispersion_ns(struct configurations *configs, struct train_stats *train) {
+	if (configs->interleave > 0) return train->busy_ns;
+	return train_dispersion_ns(configs, train) - train->departure_ns;
+}
+
+/** 
+ * This function returns the dispersion of a train (see `train_dispersion_ns`) in millis.
+ * 
+ * @param configs A pointer to the `configurations` structure of the session.
+ * @param train The statistics of the train.
+ * @return The dispersion of the train in millis.
+ */
+long train_dispersion(struct configurations *configs, struct train_stats *train) {
+	return train_dispersion_ns(configs, train) / 1000000L;
+}
+
+/** 
+ * This function closes the current run of missing sequence numbers of a train, if there is one.
+ */
+void end_loss_run(struct train_stats *train) {
+	if (train->loss_run == 0) return;
+	train->loss_runs++;
+	if (train->loss_run > train->longest_loss_run) train->longest_loss_run = train->loss_run;
+	train->loss_run = 0;
+}
+
+/** 
+ * This function slides the sequence window of a train up to `seq`: every retired sequence number 
+ * that was not received extends the current loss run, and every received one ends it. At most one 
+ * window of bits is visited; the sequence numbers beyond it were never received.
+ * 
+ * @param train The statistics of the train.
+ * @param seq The new base of the window.
+ */
+void retire_seqs(struct train_stats *train, uint32_t seq) {
+	struct seq_window *w = &train->window;
+	for (int i = 0; i < SEQ_WINDOW_BITS && w->base < seq; i++, w->base++) {
+		uint32_t bit = w->base % SEQ_WINDOW_BITS;
+		uint64_t mask = 1ULL << (bit % 64);
+		if (w->bits[bit / 64] & mask) {
+			end_loss_run(train);
+			w->bits[bit / 64] &= ~mask;
+		} else {
+			train->loss_run++;
+		}
+	}
+	if (w->base < seq) {
+		train->loss_run += seq - w->base;
+		w->base = seq;
+	}
+}
 
- * @param buf A pointer to the buffer containing the data to check.
- * @param high_entropy_data_head A pointer to the predefined low entropy data head for comparison.
- * @param high_entropy_data_head A pointer to the predefined high entropy data head for comparison.
- * @param head_len The length of the data head to compare.
+/** 
+ * This function marks a sequence number of a train as received in its window, in O(1) amortized: 
+ * every sequence number enters and leaves the window once. A packet that arrives behind the 
+ * highest sequence number so far counts as reordered, by the distance it arrived behind.
  * 
- * @return 
- * - 0 if the buffer matches the low entropy data head.
- * - 1 if the buffer matches the high entropy data head.
- * - -1 if the buffer does not match either data head.
+ * @param train The statistics of the train.
+ * @param seq The sequence number of the received packet.
+ * @return 1 if the packet is new, 0 if it is a duplicate or older than the window.
  */
-int check_entropy(unsigned char *buf, unsigned char *low_entropy_data_head, 
-	unsigned char *high_entropy_data_head, int head_len) {
+int track_seq(struct train_stats *train, uint32_t seq) {
+	struct seq_window *w = &train->window;
+	if (seq < w->base) {
+		train->late++;
+		return 0;
+	}
+	if (seq - w->base >= SEQ_WINDOW_BITS) retire_seqs(train, seq - SEQ_WINDOW_BITS + 1);
 
-	if (memcmp(buf, low_entropy_data_head, head_len) == 0) {
+	uint32_t bit = seq % SEQ_WINDOW_BITS;
+	uint64_t mask = 1ULL << (bit % 64);
+	if (w->bits[bit / 64] & mask) {
+		train->duplicates++;
 		return 0;
-	} else if (memcmp(buf, high_entropy_data_head, head_len) == 0) {
-		return 1;
+	}
+	w->bits[bit / 64] |= mask;
+
+	if (seq + 1 < train->next_seq) {
+		train->reordered++;
+		if (train->next_seq - 1 - seq > train->max_reorder) train->max_reorder = train->next_seq - 1 - seq;
 	} else {
-		return -1;
+		train->next_seq = seq + 1;
 	}
+	return 1;
 }
 
 /** 
- * This function listens for incoming UDP packets on a socket, differentiate low or high, 
- * entropy packets, and tracks the arrival time of the first and last received packets of 
- * each packet train. The receiving will stop after receiving the required number of packets, or a 
- * collective timeout (CUTOFF_TIME) is reached.
- * Once done with receiving, the function calculates the difference the difference in arrival
- * time between the first and last received packets of the two trains.
+ * This function accounts the end of a train: the sequence numbers up to `n` still in its window, 
+ * or beyond it, are retired, so the loss runs include the packets lost at the tail of the train.
+ * 
+ * @param train The statistics of the train.
+ * @param n The number of packets of the train.
+ */
+void close_seq_window(struct train_stats *train, uint32_t n) {
+	retire_seqs(train, n);
+	end_loss_run(train);
+}
+
+/** 
+ * This function adds a packet to the one-way delay trend of its train: a least squares line through 
+ * the relative one-way delay of every packet over its send time, both taken from the first packet of 
+ * the train, so the unknown offset between the clocks of the client and the server drops out. The 
+ * sums of the fit are updated the way Welford's algorithm updates a variance, so they stay accurate 
+ * over long trains. Called before the packet is counted.
+ * 
+ * @param train The train of the packet.
+ * @param header The probe header of the packet, carrying its TX timestamp.
+ * @param ts The arrival time of the packet.
+ */
+void track_owd(struct train_stats *train, struct probe_header *header, struct timespec *ts) {
+	struct timespec tx = { .tv_sec = ntohl(header->tx_sec), .tv_nsec = ntohl(header->tx_nsec) };
+	long owd_ns = (ts->tv_sec - tx.tv_sec) * 1000000000L + (ts->tv_nsec - tx.tv_nsec);
+	if (train->count == 0) {
+		train->tx_first = tx;
+		train->owd_base_ns = owd_ns;
+	}
+	double x = (tx.tv_sec - train->tx_first.tv_sec) * 1e9 + (tx.tv_nsec - train->tx_first.tv_nsec);
+	double y = owd_ns - train->owd_base_ns;
+	uint32_t k = train->count + 1;
+	double dx = x - train->owd_mean_x;
+	double dy = y - train->owd_mean_y;
+	train->owd_mean_x += dx / k;
+	train->owd_mean_y += dy / k;
+	train->owd_m2_x += dx * (x - train->owd_mean_x);
+	train->owd_m2_y += dy * (y - train->owd_mean_y);
+	train->owd_c_xy += dx * (y - train->owd_mean_y);
+}
+
+/** 
+ * This function adds the gap between a packet and the previous distinct packet of its train to the 
+ * inter-arrival gap histogram of the train, in constant time and memory. Called before the packet 
+ * becomes the last arrival of the train, for every packet but the first.
+ * 
+ * @param train The train of the packet.
+ * @param ts The arrival time of the packet.
+ */
+void track_gap(struct train_stats *train, struct timespec *ts) {
+	long gap_ns = (ts->tv_sec - train->t_last.tv_sec) * 1000000000L + (ts->tv_nsec - train->t_last.tv_nsec);
+	if (gap_ns < 0) gap_ns = 0; // a timestamp taken out of order on another CPU
+	train->gap_hist[gap_bucket(gap_ns)]++;
+	if (train->count == 1 || gap_ns < train->gap_min_ns) train->gap_min_ns = gap_ns;
+	if (gap_ns > train->gap_max_ns) train->gap_max_ns = gap_ns;
+}
+
+/** 
+ * This function times the block of SPRT_BLOCK packets `train` just received: its duration (its busy 
+ * time if the trains are interleaved) is added to the block statistics of the train, which the 
+ * sequential test and the calibration of the threshold are based on.
  * 
- * @param sock The socket file descriptor for receiving the packets.
- * @param cin A pointer to the client address structure to store the sender's address.
- * @param cin_len Length of the client's address.
  * @param configs A pointer to the `configurations` structure.
+ * @param train The train that completed a block.
+ * @return The duration of the block in nanos, or -1 for the first block, which only starts the clock.
+ */
+long time_block(struct configurations *configs, struct train_stats *train) {
+	long busy_block = train->busy_block;
+	struct timespec t_block = train->t_block;
+	train->busy_block = train->busy_ns;
+	train->t_block = train->t_last;
+	if (train->count == SPRT_BLOCK) return -1;
+
+	long duration = configs->interleave > 0 ? train->busy_ns - busy_block : 
+		(train->t_last.tv_sec - t_block.tv_sec) * 1000000000L + (train->t_last.tv_nsec - t_block.tv_nsec);
+	if (train->blocks > 0) train->block_lag_ns += (double) duration * train->block_prev_ns;
+	train->blocks++;
+	train->block_sum_ns += duration;
+	train->block_sq_ns += (double) duration * duration;
+	train->block_prev_ns = duration;
+	return duration;
+}
+
+/** 
+ * This function calibrates the threshold of a session from its baseline trains, which carry the same 
+ * low entropy payloads: any difference between them is the noise of the path. The dispersion of a 
+ * train adds up its n / SPRT_BLOCK block durations, but they are not independent: the timestamp of 
+ * the packet closing a block also opens the next one, so its jitter lengthens one block by what it 
+ * shortens the other, and cancels in the sum. With the variance g0 of the block durations of a 
+ * baseline train and the covariance g1 of consecutive blocks, the dispersion has the variance 
+ * n / SPRT_BLOCK * (g0 + 2 * g1): independent queueing noise adds up over the blocks (g1 = 0), while 
+ * pure timestamp jitter leaves only the jitter of the two ends of the train, which is at most g0. The 
+ * threshold is the difference the baseline trains showed (the bias between two trains sent one after 
+ * another) plus CALIBRATION_SIGMAS standard deviations of the difference of two dispersions.
  * 
- * @return The time difference the difference in arrival time between the first and last packets of the two trains.
- */
-long receive_packet_trains(int sock, struct sockaddr *cin, socklen_t cin_len, struct configurations *configs) {
-	int buf_len = configs->l;
-	unsigned char buf[buf_len];
-	int n = configs->n;
-	int count;
-	struct timespec t_l1, t_ln, t_h1, t_hn;
-	struct timespec t_init, t_curr;
-	clock_gettime(CLOCK_MONOTONIC, &t_init);
-	
-	int low_count = 0, high_count = 0;
-	unsigned char low_entropy_data_head[FIX_DATA_LEN] = {0};
-	while (1) {
-		count = recvfrom(sock, buf, buf_len, 0, cin, &cin_len);
+ * @param configs A pointer to the `configurations` structure.
+ * @param trains The array of `num_trains` train statistics, the baseline trains first.
+ * @param state Set to the calibrated threshold and the noise, if the baseline trains have been timed.
+ * @return 0 if the threshold is calibrated, -1 if a baseline train has fewer than SPRT_MIN_BLOCKS blocks.
+ */
+int calibrate_tau(struct configurations *configs, struct train_stats *trains, struct receive_state *state) {
+	double blocks = (double) configs->n / SPRT_BLOCK;
+	double variance = 0;
+	double mean[CALIBRATION_TRAINS];
+	for (int t = 0; t < configs->baseline_trains; t++) {
+		struct train_stats *train = &trains[t];
+		if (train->blocks < SPRT_MIN_BLOCKS) return -1;
+		mean[t] = (double) train->block_sum_ns / train->blocks;
+		double g0 = (train->block_sq_ns - train->blocks * mean[t] * mean[t]) / (train->blocks - 1);
+		double g1 = train->block_lag_ns / (train->blocks - 1) - mean[t] * mean[t];
+		double v = blocks * (g0 + 2 * g1);
+		if (v < g0) v = g0;
+		variance += v > (double) SPRT_MIN_STDDEV_NS * SPRT_MIN_STDDEV_NS ? v : (double) SPRT_MIN_STDDEV_NS * SPRT_MIN_STDDEV_NS;
+	}
+	state->noise_ns = sqrt(variance);
+	state->tau_ns = blocks * fabs(mean[1] - mean[0]) + CALIBRATION_SIGMAS * state->noise_ns;
+	return 0;
+}
+
+/** 
+ * This function runs one step of the sequential probability ratio test (SPRT) of a session, after 
+ * `train` received another SPRT_BLOCK packets, which took `duration`. If `train` is the highest or the 
+ * lowest entropy train, and the other one has samples too, the observation is the difference between 
+ * the high and the low entropy block durations, using the mean block duration of the other train. 
+ * Compression (H1) means the high entropy train is slower by `tau` (or the calibrated threshold, once 
+ * the baseline trains are timed) over `n` packets, i.e. by tau * SPRT_BLOCK / n per block; 
+ * no compression (H0) means no difference. With the variance of the observations estimated as they 
+ * arrive, the log-likelihood ratio of H1 against H0 is compared against log(c / (1 - c)) for the 
+ * configured confidence c: crossing it above decides compression, below decides no compression.
+ * 
+ * @param configs A pointer to the `configurations` structure.
+ * @param trains The array of `num_trains` train statistics.
+ * @param state The progress of receiving the trains of the session.
+ * @param train_id The train that completed a block.
+ * @param duration The duration of the block in nanos.
+ */
+void sprt_update(struct configurations *configs, struct train_stats *trains, struct receive_state *state, int train_id, 
+	long duration) {
+	int low, high;
+	find_extreme_trains(configs, &low, &high);
+	struct train_stats *other = &trains[train_id == high ? low : high];
+	if ((train_id != low && train_id != high) || other->blocks == 0) return;
+	double other_mean = (double) other->block_sum_ns / other->blocks;
+	double diff = train_id == high ? duration - other_mean : other_mean - duration;
+
+	// Welford's running mean and variance
+	state->sprt_blocks++;
+	double delta = diff - state->diff_mean;
+	state->diff_mean += delta / state->sprt_blocks;
+	state->diff_m2 += delta * (diff - state->diff_mean);
+	if (state->sprt_blocks < SPRT_MIN_BLOCKS) return;
+
+	double variance = state->diff_m2 / (state->sprt_blocks - 1);
+	if (variance < (double) SPRT_MIN_STDDEV_NS * SPRT_MIN_STDDEV_NS) variance = (double) SPRT_MIN_STDDEV_NS * SPRT_MIN_STDDEV_NS;
+	double tau_ns = configs->tau * 1e6;
+	if (configs->baseline_trains > 0) {
+		// the trains under test are only judged against a calibrated threshold
+		if (calibrate_tau(configs, trains, state) == -1) return;
+		tau_ns = state->tau_ns;
+	}
+	double mu = tau_ns * SPRT_BLOCK / configs->n;
+	state->llr = state->sprt_blocks * mu / variance * (state->diff_mean - mu / 2);
+
+	double threshold = log(configs->confidence / (1 - configs->confidence));
+	if (state->llr >= threshold) {
+		state->verdict = SPRT_COMPRESSION;
+	} else if (state->llr <= -threshold) {
+		state->verdict = SPRT_NO_COMPRESSION;
+	}
+}
+
+/** 
+ * This function accounts one received packet to its train: it is classified by its probe header, 
+ * and unless its sequence number was already received, its arrival time becomes the last arrival 
+ * of the train (and the first one, if it is the first packet of the train). The gap to the previous 
+ * arrival of any train of the session is added to the busy time of the train. Duplicates and late 
+ * packets are only counted, so they neither complete a train nor stretch its dispersion. The one-way 
+ * delay of the packet is added to the delay trend of the train, and the gap to the previous packet 
+ * of the train to its gap histogram.
+ * Every SPRT_BLOCK packets of a train, the block is timed and the sequential test of the session is 
+ * updated if it is enabled.
+ * 
+ * @param configs A pointer to the `configurations` structure.
+ * @param trains The array of `num_trains` train statistics.
+ * @param state The progress of receiving the trains of the session.
+ * @param buf The received payload.
+ * @param len The length of the received payload.
+ * @param ts The arrival time of the packet.
+ */
+void record_arrival(struct configurations *configs, struct train_stats *trains, struct receive_state *state, 
+	unsigned char *buf, int len, struct timespec *ts) {
+	int train_id = classify_packet(buf, len, configs);
+	if (train_id == -1) return;
+	uint32_t seq = ntohl(((struct probe_header *) buf)->seq);
+	struct train_stats *train = &trains[train_id];
+	if (seq >= configs->n || !track_seq(train, seq)) return;
+	track_owd(train, (struct probe_header *) buf, ts);
+	if (train->count > 0) track_gap(train, ts);
+	train->t_last = *ts;
+	if (train->count == 0) train->t_first = *ts;
+	if (state->received++ > 0) {
+		train->busy_ns += (ts->tv_sec - state->t_prev.tv_sec) * 1000000000L + (ts->tv_nsec - state->t_prev.tv_nsec);
+	}
+	state->t_prev = *ts;
+	train->count++;
+	if (train->count == configs->n) state->complete_trains++;
+	if (train->count % SPRT_BLOCK == 0) {
+		long duration = time_block(configs, train);
+		if (duration >= 0 && configs->confidence > 0 && state->verdict == SPRT_UNDECIDED) {
+			sprt_update(configs, trains, state, train_id, duration);
+		}
+	}
+}
+
+/** 
+ * This function computes the time by which the next packet of the session must arrive, or the 
+ * receiving is over. The train the last packet belonged to is considered over once no packet 
+ * arrived for IDLE_GAP_FACTOR times its mean inter-arrival gap, but at least IDLE_GAP_FLOOR_MS. 
+ * When the trains are sent one after another, each train that has not started yet is expected 
+ * `gamma` seconds later, so it extends the deadline by `gamma`.
+ * 
+ * @param configs A pointer to the `configurations` structure.
+ * @param trains The array of `num_trains` train statistics.
+ * @param state The progress of receiving the trains of the session, at least one packet received.
+ * @param deadline Set to the idle deadline (CLOCK_REALTIME, like the arrival times).
+ */
+void idle_deadline(struct configurations *configs, struct train_stats *trains, struct receive_state *state, 
+	struct timespec *deadline) {
+	long idle_ns = IDLE_GAP_FLOOR_MS * 1000000L;
+	int not_started = 0;
+	for (int t = 0; t < configs->num_trains; t++) {
+		struct train_stats *train = &trains[t];
+		if (train->count == 0) {
+			not_started++;
+		} else if (train->count > 1 && train->t_last.tv_sec == state->t_prev.tv_sec && 
+			train->t_last.tv_nsec == state->t_prev.tv_nsec) {
+			long span_ns = (train->t_last.tv_sec - train->t_first.tv_sec) * 1000000000L + 
+				(train->t_last.tv_nsec - train->t_first.tv_nsec);
+			long gap_ns = IDLE_GAP_FACTOR * (span_ns / (train->count - 1));
+			if (gap_ns > idle_ns) idle_ns = gap_ns;
+		}
+	}
+	if (configs->interleave == 0) idle_ns += not_started * configs->gamma * 1000000000L;
+
+	deadline->tv_sec = state->t_prev.tv_sec + idle_ns / 1000000000L;
+	deadline->tv_nsec = state->t_prev.tv_nsec + idle_ns % 1000000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+/** 
+ * This function sets up the recvmmsg receive engine: RECV_BATCH_SIZE buffers of `l` bytes, each 
+ * with room for the kernel timestamp cmsg.
+ * 
+ * @param mr The recvmmsg receive engine to set up.
+ * @param sock The UDP socket the packets are read from.
+ * @param l The number of bytes read of each UDP payload.
+ * @return void. Exits the program on failure.
+ */
+void setup_mmsg_receiver(struct mmsg_receiver *mr, int sock, uint32_t l) {
+	mr->sock = sock;
+	mr->bufs = malloc((size_t) RECV_BATCH_SIZE * l);
+	mr->controls = calloc(RECV_BATCH_SIZE, CMSG_SPACE(sizeof(struct timespec)));
+	mr->msgs = calloc(RECV_BATCH_SIZE, sizeof(struct mmsghdr));
+	mr->iovs = calloc(RECV_BATCH_SIZE, sizeof(struct iovec));
+	if (mr->bufs == NULL || mr->controls == NULL || mr->msgs == NULL || mr->iovs == NULL) {
+		perror("Failed to allocate memory for the receive batch");
+		close(sock);
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < RECV_BATCH_SIZE; i++) {
+		mr->iovs[i].iov_base = mr->bufs + (size_t) i * l;
+		mr->iovs[i].iov_len = l;
+		mr->msgs[i].msg_hdr.msg_iov = &mr->iovs[i];
+		mr->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+/** 
+ * This function reads all packets waiting in the socket in batches of up to RECV_BATCH_SIZE with 
+ * `recvmmsg`, and hands each of them to its session with `dispatch_packet`. The arrival time of 
+ * a packet is its kernel receive timestamp, or the time the batch was read if the kernel did not 
+ * attach one.
+ * 
+ * @param mr The recvmmsg receive engine.
+ * @param server The server the sessions of the packets are looked up in.
+ * @param worker The receive worker reading the socket, or NULL for the main thread.
+ * 
+ * @return 0 on success, or -1 if reading the socket failed.
+ */
+int drain_mmsg_receiver(struct mmsg_receiver *mr, struct probe_server *server, struct recv_worker *worker) {
+	// a batch that is not full means the socket is empty for now
+	int count = RECV_BATCH_SIZE;
+	while (count == RECV_BATCH_SIZE) {
+		// the control buffer length is an in-out argument, restore it before every call
+		for (int i = 0; i < RECV_BATCH_SIZE; i++) {
+			mr->msgs[i].msg_hdr.msg_control = mr->controls + i * CMSG_SPACE(sizeof(struct timespec));
+			mr->msgs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(struct timespec));
+		}
+		count = recvmmsg(mr->sock, mr->msgs, RECV_BATCH_SIZE, 0, NULL);
 		if (count == -1) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				clock_gettime(CLOCK_MONOTONIC, &t_curr);
-				if (t_curr.tv_sec - t_init.tv_sec > CUTOFF_TIME) {
-					break;
-				} else {
-					continue; // No data available (non-blocking)
-				}
-			} else {
-				perror("Failed to receive UDP packet");
-				close(sock);
-				exit(EXIT_FAILURE);
-			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			perror("Failed to receive UDP packets");
+			return -1;
 		}
-		
-		int entropy = check_entropy(buf + sizeof(uint16_t), low_entropy_data_head, configs->udp_head_bytes, 10);
-		if (entropy == 0) {
-			if (low_count == 0) clock_gettime(CLOCK_MONOTONIC, &t_l1);
-			clock_gettime(CLOCK_MONOTONIC, &t_ln);
-			low_count++;
-		} else if (entropy == 1) {
-			if (high_count == 0) clock_gettime(CLOCK_MONOTONIC, &t_h1);
-			clock_gettime(CLOCK_MONOTONIC, &t_hn);
-			high_count++;
-		} 
-
-		if (low_count == n && high_count == n) {
-			break;
+
+		struct timespec t_read;
+		clock_gettime(CLOCK_REALTIME, &t_read);
+		for (int i = 0; i < count; i++) {
+			struct timespec ts;
+			if (!rx_timestamp(&mr->msgs[i].msg_hdr, &ts)) ts = t_read;
+			dispatch_packet(server, worker, (unsigned char *) mr->iovs[i].iov_base, mr->msgs[i].msg_len, &ts);
 		}
 	}
-    
-	// arrival time between first and last packet for low entropy packet train
-	long t_l = (t_ln.tv_sec - t_l1.tv_sec) * 1000L + (t_ln.tv_nsec - t_l1.tv_nsec) / 1000000L;
-	// arrival time between first and last packet for long entropy packet train
-	long t_h = (t_hn.tv_sec - t_h1.tv_sec) * 1000L + (t_hn.tv_nsec - t_h1.tv_nsec) / 1000000L;
-	return t_h - t_l;
+	return 0;
 }
 
 /** 
- * This function performs server's probing task: Receives UDP packet trains, calculates the time difference, 
- * and set `detect_result`based on the calculated time difference and threshold `tau`.
+ * This function returns the UDP listener of `port` in `listeners`, and opens it if no session has sent 
+ * to the port yet: a non-blocking UDP socket bound to the port, with a large receive buffer and kernel 
+ * receive timestamps, read by the receive engine `engine` (or by `recvmmsg` if the io_uring engine is 
+ * unavailable). The socket is watched by `epfd`, and stays open for the later sessions.
  * 
- * @param configs A pointer to the `configurations` structure.
- * @param detect_result A pointer to an integer that will hold the detection result
- *                      (1 for detected, 0 for not detected).
+ * @param listeners The UDP listeners of the thread reading the socket.
+ * @param num_listeners The number of open listeners in `listeners`, incremented if the port is opened.
+ * @param epfd The epoll instance of the thread reading the socket.
+ * @param port The UDP port the trains are sent to.
+ * @param engine The receive engine (RECV_ENGINE_*) used if the port is opened.
+ * @param reuseport Whether the port is shared by the sockets of several receive workers (SO_REUSEPORT).
  * 
- * @return void. This function makes the detection decision and modifies the `detect_result` based on the time difference.
+ * @return The UDP listener, or NULL if the port could not be opened.
  */
-void serve_probe(struct configurations *configs, int *detect_result) {
+struct udp_listener *open_udp_listener(struct udp_listener *listeners, int *num_listeners, int epfd, 
+	uint16_t port, int engine, int reuseport) {
+	for (int i = 0; i < *num_listeners; i++) {
+		if (listeners[i].port == port) return &listeners[i];
+	}
+	if (*num_listeners == MAX_UDP_PORTS) {
+		printf("Too many UDP ports, cannot open port %u\n", port);
+		return NULL;
+	}
+
 	int sock = socket(AF_INET, SOCK_DGRAM, 0);
 	if (sock == -1) {
 	    perror("Socket creation failed");
-	    exit(EXIT_FAILURE);
+	    return NULL;
+	}
+
+	// The kernel spreads the flows sent to the port over the sockets of the workers
+	int enable = 1;
+	if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1) {
+		perror("Failed to set SO_REUSEPORT");
+		close(sock);
+		return NULL;
 	}
 
 	// Assign address to socket
-	struct sockaddr_in sin, cin;
+	struct sockaddr_in sin;
 	memset(&sin, 0, sizeof(sin));
 
 	sin.sin_family = AF_INET;
 	sin.sin_addr.s_addr = INADDR_ANY;
-	sin.sin_port = htons(configs->udp_dst_port);
+	sin.sin_port = htons(port);
 
 	if (bind(sock, (struct sockaddr*) &sin, sizeof(sin)) == -1) {
 		perror("Cannot bind socket to address");
 		close(sock);
-		exit(EXIT_FAILURE);
+		return NULL;
 	}
 
 	// Set non-blocking
@@ -181,15 +604,250 @@ void serve_probe(struct configurations *configs, int *detect_result) {
 	// Increase sys buf size
 	increase_sys_rcvbuf_size(sock);
 
-	// Receive diagrams and caculate time difference
-	socklen_t cin_len = sizeof(cin);
-	long time_difference = receive_packet_trains(sock, (struct sockaddr *)&cin, cin_len, configs);
+	// Timestamp the arrivals in the kernel
+	if (enable_rx_timestamps(sock) == -1) {
+		printf("Kernel receive timestamps are unavailable, timestamping the packets when they are read\n");
+	}
 
-	if (time_difference > configs->tau) {
-		*detect_result = 1;
-	} else {
-		*detect_result = 0;
+	int index = (*num_listeners)++;
+	struct udp_listener *listener = &listeners[index];
+	listener->port = port;
+	listener->engine = engine;
+	if (engine == RECV_ENGINE_IO_URING && setup_uring_receiver(&listener->ur, sock, RECV_PAYLOAD_LEN) == -1) {
+		printf("io_uring receive is unavailable, receiving the trains with recvmmsg\n");
+		listener->engine = RECV_ENGINE_RECVMMSG;
+	}
+	setup_mmsg_receiver(&listener->mr, sock, RECV_PAYLOAD_LEN);
+	watch_fd(epfd, listener->engine == RECV_ENGINE_IO_URING ? listener->ur.ring_fd : sock, EV_UDP, index);
+	return listener;
+}
+
+/** 
+ * This function makes sure the trains sent to `port` are received: by one UDP listener of the main 
+ * thread, or by one SO_REUSEPORT listener of every receive worker. In daemon mode, the ports are all 
+ * opened at startup, and a port that is not open is refused instead.
+ * 
+ * @param server The server.
+ * @param port The UDP port the trains are sent to.
+ * @param engine The receive engine (RECV_ENGINE_*) used if the port is opened.
+ * 
+ * @return 0 on success, or -1 if the port could not be opened.
+ */
+int open_udp_port(struct probe_server *server, uint16_t port, int engine) {
+	if (server->fixed_ports) {
+		struct udp_listener *listeners = server->num_workers == 0 ? server->listeners : server->workers[0].listeners;
+		int num_listeners = server->num_workers == 0 ? server->num_listeners : server->workers[0].num_listeners;
+		for (int i = 0; i < num_listeners; i++) {
+			if (listeners[i].port == port) return 0;
+		}
+		printf("UDP port %u is not served\n", port);
+		return -1;
+	}
+	if (server->num_workers == 0) {
+		return open_udp_listener(server->listeners, &server->num_listeners, server->epfd, port, engine, 0) == NULL ? -1 : 0;
+	}
+	for (int w = 0; w < server->num_workers; w++) {
+		struct recv_worker *worker = &server->workers[w];
+		if (open_udp_listener(worker->listeners, &worker->num_listeners, worker->epfd, port, engine, 1) == NULL) return -1;
+	}
+	return 0;
+}
+
+/** 
+ * This function reads the packets waiting on a UDP listener with its receive engine, and hands each 
+ * of them to its session. If the io_uring engine fails, e.g. because the kernel does not support 
+ * multishot recvmsg, the listener falls back to `recvmmsg`.
+ * 
+ * @param server The server the listener belongs to.
+ * @param worker The receive worker the listener belongs to, or NULL for the main thread.
+ * @param listener The UDP listener.
+ * 
+ * @return 0 on success, or -1 if reading the socket failed.
+ */
+int drain_udp_listener(struct probe_server *server, struct recv_worker *worker, struct udp_listener *listener) {
+	if (listener->engine == RECV_ENGINE_IO_URING) {
+		if (drain_uring_receiver(&listener->ur, server, worker) == 0) return 0;
+		printf("io_uring receive failed, receiving the trains with recvmmsg\n");
+		int epfd = worker == NULL ? server->epfd : worker->epfd;
+		struct udp_listener *listeners = worker == NULL ? server->listeners : worker->listeners;
+		epoll_ctl(epfd, EPOLL_CTL_DEL, listener->ur.ring_fd, NULL);
+		close_uring_receiver(&listener->ur);
+		listener->engine = RECV_ENGINE_RECVMMSG;
+		watch_fd(epfd, listener->mr.sock, EV_UDP, listener - listeners);
+	}
+	return drain_mmsg_receiver(&listener->mr, server, worker);
+}
+
+/** 
+ * This function picks the trains the detection compares: the one with the lowest and the one with
+ * the highest percentage of random content. Text-like trains are only reported, and if fewer than 
+ * two trains have a graded level, the first and the last train are compared. The baseline trains 
+ * only calibrate the threshold, they are never compared.
+ * 
+ * @param configs A pointer to the `configurations` structure.
+ * @param low Set to the index of the lowest entropy train.
+ * @param high Set to the index of the highest entropy train.
+ */
+void find_extreme_trains(struct configurations *configs, int *low, int *high) {
+	*low = -1;
+	*high = -1;
+	for (int t = configs->baseline_trains; t < configs->num_trains; t++) {
+		uint8_t level = configs->entropy_levels[t];
+		if (level == ENTROPY_TEXT) continue;
+		if (*low == -1 || level < configs->entropy_levels[*low]) *low = t;
+		if (*high == -1 || level > configs->entropy_levels[*high]) *high = t;
+	}
+	if (*low == *high) {
+		*low = configs->baseline_trains;
+		*high = configs->num_trains - 1;
+	}
+}
+
+/** 
+ * This function makes the detection decision of a session: the decision of the sequential test if it 
+ * reached one, otherwise it calculates the time difference between the dispersion of the highest and 
+ * the lowest entropy train (the dispersion added by the path, if the departures were timestamped), 
+ * and compares it to the threshold: `tau`, or the threshold calibrated 
+ * from the baseline trains if the session sent them and they could be timed.
+ * 
+ * @param configs A pointer to the `configurations` structure of the session.
+ * @param trains The arrival statistics of the trains of the session.
+ * @param state The progress of receiving the trains of the session.
+ * 
+ * @return The detection result (1 for detected, 0 for not detected).
+ */
+int detect_compression(struct configurations *configs, struct train_stats *trains, struct receive_state *state) {
+	int calibrated = configs->baseline_trains > 0 && calibrate_tau(configs, trains, state) == 0;
+	if (state->verdict != SPRT_UNDECIDED) return state->verdict == SPRT_COMPRESSION;
+	int low, high;
+	find_extreme_trains(configs, &low, &high);
+	long difference_ns = path_dispersion_ns(configs, &trains[high]) - path_dispersion_ns(configs, &trains[low]);
+	if (calibrated) return difference_ns > state->tau_ns;
+	return difference_ns / 1000000L > configs->tau;
+}
+
+/** 
+ * This function performs server's probing task for a session whose UDP listener is open: it resets the 
+ * arrival statistics of the trains, sets the collective timeout (CUTOFF_TIME) of the session, and tells 
+ * the client over the control channel to start sending the UDP packet trains.
+ * 
+ * @param s The session.
+ * @return 0 on success, or -1 if the client could not be notified.
+ */
+int start_probe(struct session *s) {
+	memset(s->trains, 0, sizeof(s->trains));
+	memset(&s->recv, 0, sizeof(s->recv));
+	s->arrivals = 0;
+	clock_gettime(CLOCK_REALTIME, &s->cutoff);
+	s->cutoff.tv_sec += CUTOFF_TIME;
+
+	// The socket queues the packets from now on, let the client start sending
+	if (send_ctrl_msg(s->ctrl_sock, CTRL_READY, NULL, 0) == -1) {
+		perror("Failed to notify client");
+		return -1;
 	}
+	return 0;
+}
 
-	close(sock);
+/** 
+ * This function computes the time the receiving of a session ends if no further packet arrives: its 
+ * `idle_deadline` once a packet was received, and at the latest its collective timeout.
+ * 
+ * @param s The session, receiving its trains.
+ * @param deadline Set to the deadline (CLOCK_REALTIME).
+ */
+void session_deadline(struct session *s, struct timespec *deadline) {
+	*deadline = s->cutoff;
+	if (s->recv.received == 0) return;
+
+	struct timespec idle;
+	idle_deadline(&s->configs, s->trains, &s->recv, &idle);
+	if (idle.tv_sec < deadline->tv_sec || (idle.tv_sec == deadline->tv_sec && idle.tv_nsec < deadline->tv_nsec)) {
+		*deadline = idle;
+	}
+}
+
+/** 
+ * This function reads the CTRL_TX_REPORT messages of a session that have arrived on its control 
+ * channel, without blocking, and stores the departure dispersion of each train they report.
+ * 
+ * @param s The session, receiving its trains.
+ * 
+ * @return 0 on success, or -1 if the client closed the connection or sent an invalid message.
+ */
+int receive_tx_reports(struct session *s) {
+	while (1) {
+		int count = recv(s->ctrl_sock, s->ctrl_buf + s->ctrl_len, sizeof(s->ctrl_buf) - s->ctrl_len, MSG_DONTWAIT);
+		if (count == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR) continue;
+			perror("Failed to receive departures");
+			return -1;
+		}
+		if (count == 0) return -1; // the client closed the connection
+		s->ctrl_len += count;
+		if (s->ctrl_len == sizeof(s->ctrl_buf)) break;
+	}
+
+	uint32_t used = 0;
+	while (s->ctrl_len - used >= CTRL_HEADER_LEN) {
+		struct ctrl_header header;
+		memcpy(&header, s->ctrl_buf + used, CTRL_HEADER_LEN);
+		if (header.type != CTRL_TX_REPORT || ntohl(header.len) != sizeof(struct tx_report)) {
+			printf("Invalid message from the client of session %u\n", s->configs.session_id);
+			return -1;
+		}
+		if (s->ctrl_len - used < CTRL_HEADER_LEN + sizeof(struct tx_report)) break;
+
+		struct tx_report tx;
+		memcpy(&tx, s->ctrl_buf + used + CTRL_HEADER_LEN, sizeof(tx));
+		uint16_t train_id = ntohs(tx.train_id);
+		if (train_id < s->configs.num_trains) {
+			s->departure_ns[train_id] = tx.clock == TX_CLOCK_NONE ? 0 : 
+				ntohl(tx.dispersion_sec) * 1000000000L + ntohl(tx.dispersion_nsec);
+			s->tx_reports++;
+		}
+		used += CTRL_HEADER_LEN + sizeof(struct tx_report);
+	}
+	memmove(s->ctrl_buf, s->ctrl_buf + used, s->ctrl_len - used);
+	s->ctrl_len -= used;
+	return 0;
+}
+
+/** 
+ * This function tells whether the probing of a session is over before its deadline: its sequential 
+ * test decided, or all the packets of its trains arrived and, if the client timestamps the departures, 
+ * the departures of every train have been reported.
+ * 
+ * @param s The session, receiving its trains.
+ * @return 1 if the session can get its result, 0 otherwise.
+ */
+int probe_complete(struct session *s) {
+	if (s->recv.verdict != SPRT_UNDECIDED) return 1;
+	return s->recv.complete_trains == s->configs.num_trains && 
+		(!s->configs.tx_timestamps || s->tx_reports >= s->configs.num_trains);
+}
+
+/** 
+ * This function ends the probing of a session, because all its packets arrived, the sequential test 
+ * decided, or the remaining packets are considered lost: it accounts the packets missing at the end 
+ * of every train, makes the detection decision and sends the result to the client. If the sequential 
+ * test decided, the client is first told to stop sending, and the trains are only accounted up to 
+ * the packets that were sent. The departure dispersions the client reported are applied to the trains, 
+ * which are final now even with receive workers. If the client asked for a report, it is queued in 
+ * `out` for the caller to send. If the arrivals of the session were traced, the trace is written out.
+ * 
+ * @param s The session.
+ */
+void finish_probe(struct session *s) {
+	int stopped = s->recv.verdict != SPRT_UNDECIDED;
+	if (stopped && send_ctrl_msg(s->ctrl_sock, CTRL_STOP, NULL, 0) == -1) perror("Failed to stop the client");
+	for (int t = 0; t < s->configs.num_trains; t++) {
+		close_seq_window(&s->trains[t], expected_packets(&s->configs, &s->trains[t], &s->recv));
+		s->trains[t].departure_ns = s->departure_ns[t];
+	}
+	int detect_result = detect_compression(&s->configs, s->trains, &s->recv);
+	s->out_len = serve_post_probe(s->ctrl_sock, &s->configs, s->trains, &s->recv, detect_result, s->out);
+	s->out_sent = 0;
+	if (s->trace != NULL) export_trace(s->trace, &s->configs);
 }
@@ -13,10 +13,9 @@
 
 #include "standalone.h"
 #include "payload_generator.h"
+#include "train_sender.h"
 
 #define RECV_BUFF_SIZE 4096
-#define IPH_ID 54321 //IP header identifier for SYN packets
-#define SYN_TTL 64   //TTL for SYN packets
 #define TCP_WIN_SIZE 65535 //TCP window size for the SYN packets
 
 /** the time that the application would spend to listen for the RST packet for the 
@@ -226,7 +225,8 @@ void set_df(int fd) {
 /**
  * This function generates a payload for UDP packets and sends a series of packets 
  * (packet train) to the specified server using the given socket descriptor. The 
- * packet IDs are filled, and each packet is sent in sequence.
+ * packet IDs are filled, and the packets are handed to the kernel in batches of 
+ * `batch_size` by `send_train`.
  * 
  * @param sock_udp The UDP socket descriptor used to send the packets.
  * @param configs The configuration structure containing packet details such as size and number of packets.
@@ -238,23 +238,65 @@ void set_df(int fd) {
 int send_UDP_train(int sock_udp, struct configurations *configs, 
 	struct sockaddr_in *server_sin, int high) {
 	// Generate udp payload
-	unsigned char *payload = generate_payload(configs->l, high);
+	int entropy = high ? ENTROPY_HIGH : ENTROPY_LOW;
+	unsigned char *payload = generate_payload(configs->l, entropy);
+	fill_probe_header(payload, configs->session_id, high, entropy);
 
 	// Send packet train
-	int count;
-	for (int i = 0; i < configs->n; i++) {
-		fill_packet_id(payload, i);
-		count = sendto(sock_udp, payload, configs->l, 0, (struct sockaddr *) server_sin, sizeof(struct sockaddr_in));
-		if (count == -1) {
-			perror("Failed to send UDP packet");
-			free(payload);
-			return -1;
-		}
+	struct send_options opts = { .mode = configs->send_mode, .batch_size = configs->batch_size, 
+		.rate_pps = configs->rate_pps, .pacing = configs->pacing };
+	struct train_report report;
+	if (send_train(sock_udp, server_sin, payload, configs->l, configs->n, &opts, &report) == -1) {
+		free(payload);
+		return -1;
 	}
+	print_train_report(high ? "High entropy train" : "Low entropy train", &report);
 	free(payload); //free allocated resource
 	return 0;
 }
 
+/**
+ * This function performs the detect tasks of `send_detect_packets` through a PACKET_MMAP TX ring:
+ * for each of the low and high entropy measurements, the head SYN, the UDP packet train and the 
+ * tail SYN are pre-built as frames in one ring and flushed with a single kick, so they leave in 
+ * order and without gaps between the SYNs and the train.
+ * 
+ * @param configs The configuration structure containing settings for the detection process.
+ * 
+ * @return 0 on success, or -1 if the TX ring cannot be set up and the caller should use the sockets.
+ */
+int send_detect_frames(struct configurations *configs) {
+	struct tx_ring ring;
+	if (setup_tx_ring(&ring, configs) == -1) {
+		return -1;
+	}
+
+	for (int high = 0; high <= 1; high++) {
+		if (high) {
+			// Wait for inter-measurement time
+			sleep(configs->gamma);
+		}
+		int entropy = high ? ENTROPY_HIGH : ENTROPY_LOW;
+		unsigned char *payload = generate_payload(configs->l, entropy);
+		fill_probe_header(payload, configs->session_id, high, entropy);
+		fill_tx_ring(&ring, configs, payload);
+		free(payload);
+
+		if (!high) {
+			pthread_mutex_lock(&lock); 
+			clock_gettime(CLOCK_MONOTONIC, &t_first_SYN_sent); //Start timer as soon as the first SYN is sent
+			pthread_mutex_unlock(&lock);
+		}
+		if (flush_tx_ring(&ring) == -1) {
+			close_tx_ring(&ring);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	close_tx_ring(&ring);
+	return 0;
+}
+
 /**
  * This function performs the following detect tasks:
  * 1. Creates raw TCP socket and normal UDP socket for sending SYN packets and UDP packet trains.
@@ -262,6 +304,8 @@ int send_UDP_train(int sock_udp, struct configurations *configs,
  * 3. Sends SYN packets at the start (head SYN) and end (tail SYN) of a UDP packet train.
  * 4. Sends UDP packet trains with either low-entropy or high-entropy payloads based on configuration.
  * 5. Waits for an inter-measurement period before sending another round of SYN packets and UDP packet train.
+ * If `tx_ring` is configured, the tasks are performed by `send_detect_frames` instead, falling back
+ * to the sockets when the TX ring cannot be set up.
  * 
  * @param arg A pointer to the configuration structure containing settings for the detection process.
  * 
@@ -270,6 +314,11 @@ int send_UDP_train(int sock_udp, struct configurations *configs,
 void send_detect_packets(void *arg) {
 	struct configurations *configs = (struct configurations *) arg;
 
+	if (configs->tx_ring) {
+		if (send_detect_frames(configs) == 0) return;
+		printf("TX ring is unavailable, sending with raw and UDP sockets\n");
+	}
+
 	int sock_syn = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
 	if (sock_syn == -1) {
 	    perror("SYN raw socket creation failed");
@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+
+#include "server.h"
+
+/** the number of events handled per epoll_wait() call of a receive worker */
+#define WORKER_EVENTS 16
+
+/** 
+ * This function is the body of a receive worker: it sleeps in `epoll_wait` on its own UDP sockets, 
+ * and reads the packets of every readable one into its partial results of the sessions. The sessions 
+ * are only read, under the read lock of the server; the main thread changes them under the write lock.
+ * 
+ * @param arg The receive worker.
+ * @return Never returns; the program exits if reading a socket fails.
+ */
+void *recv_worker_main(void *arg) {
+	struct recv_worker *worker = (struct recv_worker *) arg;
+	struct probe_server *server = worker->server;
+	struct epoll_event events[WORKER_EVENTS];
+	while (1) {
+		int ready = epoll_wait(worker->epfd, events, WORKER_EVENTS, -1);
+		if (ready == -1) {
+			if (errno == EINTR) continue;
+			perror("Failed to wait for events");
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_rwlock_rdlock(&server->lock);
+		for (int e = 0; e < ready; e++) {
+			struct udp_listener *listener = &worker->listeners[(uint32_t) events[e].data.u64];
+			if (drain_udp_listener(server, worker, listener) == -1) exit(EXIT_FAILURE);
+		}
+		pthread_rwlock_unlock(&server->lock);
+	}
+	return NULL;
+}
+
+/** 
+ * This function allocates `num_workers` receive workers, each with its own epoll instance and partial 
+ * results of the sessions. From then on, every UDP port is opened once per worker with SO_REUSEPORT, 
+ * and the kernel hashes each flow to one of the sockets. The threads are started by `run_recv_workers`.
+ * 
+ * @param server The server.
+ * @param num_workers The number of receive workers, at most MAX_RECV_WORKERS.
+ * @return void. Exits the program on failure.
+ */
+void setup_recv_workers(struct probe_server *server, int num_workers) {
+	server->workers = calloc(num_workers, sizeof(struct recv_worker));
+	if (server->workers == NULL) {
+		perror("Failed to allocate memory for the receive workers");
+		exit(EXIT_FAILURE);
+	}
+	server->num_workers = num_workers;
+
+	long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_cores < 1) num_cores = 1;
+	for (int w = 0; w < num_workers; w++) {
+		struct recv_worker *worker = &server->workers[w];
+		worker->server = server;
+		worker->core = w % num_cores;
+		worker->parts = calloc(MAX_SESSIONS, sizeof(struct session_part));
+		worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (worker->parts == NULL || worker->epfd == -1) {
+			perror("Failed to set up receive worker");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/** 
+ * This function starts the threads of the receive workers, each pinned to its own core (wrapping 
+ * around if there are fewer cores).
+ * 
+ * @param server The server, with its receive workers set up.
+ * @return void. Exits the program on failure.
+ */
+void run_recv_workers(struct probe_server *server) {
+	for (int w = 0; w < server->num_workers; w++) {
+		struct recv_worker *worker = &server->workers[w];
+		if (pthread_create(&worker->thread, NULL, recv_worker_main, worker) != 0) {
+			perror("Failed to create receive worker");
+			exit(EXIT_FAILURE);
+		}
+
+		// a worker that is not pinned still receives, only with more cache misses
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->core, &cpus);
+		if (pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus) != 0) {
+			printf("Failed to pin receive worker %d to core %d\n", w, worker->core);
+		}
+	}
+}
+
+/** 
+ * This function clears the partial results of a session in all the receive workers, before the 
+ * session starts receiving. Called by the main thread under the write lock.
+ * 
+ * @param server The server.
+ * @param s The session.
+ */
+void reset_session_parts(struct probe_server *server, struct session *s) {
+	for (int w = 0; w < server->num_workers; w++) {
+		memset(&server->workers[w].parts[s - server->sessions], 0, sizeof(struct session_part));
+	}
+}
+
+/** 
+ * This function merges the statistics of the same train received by two receive workers into `dst`: 
+ * the counts, busy times and gap histograms add up, and the arrival span covers both. The packets of 
+ * a train are one flow, which the kernel hands to one worker, so only that worker's sequence window is kept.
+ * 
+ * @param dst The merged statistics.
+ * @param src The statistics of the train in one receive worker.
+ */
+void merge_train_stats(struct train_stats *dst, struct train_stats *src) {
+	if (src->count == 0) return;
+	if (dst->count == 0) {
+		*dst = *src;
+		return;
+	}
+	if (src->t_first.tv_sec < dst->t_first.tv_sec || 
+		(src->t_first.tv_sec == dst->t_first.tv_sec && src->t_first.tv_nsec < dst->t_first.tv_nsec)) {
+		dst->t_first = src->t_first;
+	}
+	if (src->t_last.tv_sec > dst->t_last.tv_sec || 
+		(src->t_last.tv_sec == dst->t_last.tv_sec && src->t_last.tv_nsec > dst->t_last.tv_nsec)) {
+		dst->t_last = src->t_last;
+	}
+	for (int b = 0; b < GAP_HIST_BUCKETS; b++) dst->gap_hist[b] += src->gap_hist[b];
+	if (src->count > 1 && (dst->count < 2 || src->gap_min_ns < dst->gap_min_ns)) dst->gap_min_ns = src->gap_min_ns;
+	if (src->gap_max_ns > dst->gap_max_ns) dst->gap_max_ns = src->gap_max_ns;
+	dst->count += src->count;
+	dst->busy_ns += src->busy_ns;
+	dst->duplicates += src->duplicates;
+	dst->late += src->late;
+	dst->reordered += src->reordered;
+	if (src->max_reorder > dst->max_reorder) dst->max_reorder = src->max_reorder;
+}
+
+/** 
+ * This function merges the partial results of a session from all the receive workers into its 
+ * train statistics and receive progress, so the deadline and the detection see every packet. 
+ * Called by the main thread under the write lock.
+ * 
+ * @param server The server.
+ * @param s The session.
+ */
+void collect_session_parts(struct probe_server *server, struct session *s) {
+	memset(s->trains, 0, sizeof(s->trains));
+	memset(&s->recv, 0, sizeof(s->recv));
+	for (int w = 0; w < server->num_workers; w++) {
+		struct session_part *part = &server->workers[w].parts[s - server->sessions];
+		for (int t = 0; t < s->configs.num_trains; t++) merge_train_stats(&s->trains[t], &part->trains[t]);
+		if (part->recv.received > 0 && (s->recv.received == 0 || part->recv.t_prev.tv_sec > s->recv.t_prev.tv_sec || 
+			(part->recv.t_prev.tv_sec == s->recv.t_prev.tv_sec && part->recv.t_prev.tv_nsec > s->recv.t_prev.tv_nsec))) {
+			s->recv.t_prev = part->recv.t_prev;
+		}
+		s->recv.received += part->recv.received;
+		// the trains of a session are one flow, so one worker ran the sequential test on all of them
+		if (s->recv.verdict == SPRT_UNDECIDED && (part->recv.sprt_blocks > s->recv.sprt_blocks || part->recv.verdict != SPRT_UNDECIDED)) {
+			s->recv.verdict = part->recv.verdict;
+			s->recv.sprt_blocks = part->recv.sprt_blocks;
+			s->recv.diff_mean = part->recv.diff_mean;
+			s->recv.diff_m2 = part->recv.diff_m2;
+			s->recv.llr = part->recv.llr;
+		}
+	}
+	for (int t = 0; t < s->configs.num_trains; t++) {
+		if (s->trains[t].count >= s->configs.n) s->recv.complete_trains++;
+	}
+}
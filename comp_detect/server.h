@@ -1,18 +1,364 @@
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "probe_header.h"
+#include "control_channel.h"
 #define ADDR_LEN 32
-#define FIX_DATA_LEN 10
+/** the size of the buffer holding the JSON configurations of a session */
+#define CONFIG_BUF_SIZE 1024
+/** the number of client sessions the server serves at the same time */
+#define MAX_SESSIONS 256
+/** the number of slots of the session table, a power of 2 larger than MAX_SESSIONS */
+#define SESSION_HASH_SIZE 512
+/** the number of distinct UDP ports the sessions can send their trains to */
+#define MAX_UDP_PORTS 16
+/** the bytes read of each UDP payload; packets are classified by their probe header only */
+#define RECV_PAYLOAD_LEN 2048
+/** the largest number of receive worker threads */
+#define MAX_RECV_WORKERS 64
+/** the number of sessions whose arrivals can be traced at the same time */
+#define TRACE_ARENAS 8
+/** the bytes of encoded arrivals one trace holds, about 7 bytes per packet */
+#define TRACE_ARENA_SIZE (4 * 1024 * 1024)
+/** the number of CTRL_REPORT messages that can be in flight at the same time */
+#define REPORT_BUFFERS 8
+/** the seconds a client has to read its result and report and close the control channel */
+#define REPORT_TIMEOUT 5
+/** the number of sequence numbers of a train tracked at once, a multiple of 64; packets older than the window are late */
+#define SEQ_WINDOW_BITS 2048
+/** the number of packets of a train per observation of the sequential test */
+#define SPRT_BLOCK 64
+/** the number of observations before the sequential test may decide, so their variance is known */
+#define SPRT_MIN_BLOCKS 8
+/** the smallest standard deviation (in ns) assumed for an observation, the jitter of the timestamps */
+#define SPRT_MIN_STDDEV_NS 1000
+/** the number of standard deviations of the path noise a calibrated threshold lies above the baseline */
+#define CALIBRATION_SIGMAS 3
+/** the standard normal quantile of a two-sided 95% confidence interval of an estimate */
+#define ESTIMATE_Z 1.96
+/** the inter-arrival gap histogram of a train splits every power of 2 of nanos into 2^GAP_HIST_SUB_BITS buckets */
+#define GAP_HIST_SUB_BITS 3
+/** gaps of 2^GAP_HIST_MAX_EXP nanos (about 69 s) and longer are counted in the last bucket of the histogram */
+#define GAP_HIST_MAX_EXP 36
+#define GAP_HIST_BUCKETS ((GAP_HIST_MAX_EXP - GAP_HIST_SUB_BITS + 1) << GAP_HIST_SUB_BITS)
+/** the number of UDP packets read by one recvmmsg() call */
+#define RECV_BATCH_SIZE 64
+/** the number of receive buffers provided to the io_uring receive engine, a power of 2 */
+#define URING_BUF_COUNT 4096
+
+/** Receive engines, selected by the `recv_engine` config */
+#define RECV_ENGINE_RECVMMSG 0 // batches of packets per recvmmsg(), woken up by epoll
+#define RECV_ENGINE_IO_URING 1 // one multishot recvmsg request on an io_uring with a provided-buffer ring
 
 struct configurations {
-	uint16_t server_port_postprobing;
 	uint16_t udp_dst_port;
-	unsigned char udp_head_bytes[FIX_DATA_LEN];  // the first 10 bytes after packet id in udp packet payload
 	uint32_t l; // the Size of the UDP Payload in a UDP Packet
 	uint32_t n; // the Number of Packets in the UDP Packet Train
+	uint16_t gamma; // the time (in secs) the client waits between two UDP Packet Trains
 	uint16_t tau; // threshold of time diff (in millis) between low and high entropy data
+	uint32_t session_id; // the session tag carried in the probe header of the client's UDP Packets
+	uint16_t num_trains; // the Number of UDP Packet Trains sent in the session
+	uint8_t entropy_levels[MAX_TRAINS]; // the entropy level of each UDP Packet Train (ENTROPY_*)
+	uint32_t interleave; // the Number of consecutive Packets of a train when the client interleaves the trains, 0 if it does not
+	int recv_engine; // the engine reading the UDP Packet Trains from the socket (RECV_ENGINE_*), if the session opens it
+	double confidence; // the confidence the sequential test decides at, stopping the trains early; 0 disables it
+	uint16_t baseline_trains; // the leading trains sent at the lowest entropy level to calibrate `tau`, 0 if it is fixed
+	int tx_timestamps; // the client reports the departure dispersion of every train (CTRL_TX_REPORT)
+	int report; // the client asked for the structured result (CTRL_REPORT) after the result message
+};
+
+/** 
+ * Sliding bitmap of the sequence numbers received in [base, base + SEQ_WINDOW_BITS). Sequence 
+ * numbers below `base` are retired: whether they were received is already accounted.
+ */
+struct seq_window {
+	uint32_t base;
+	uint64_t bits[SEQ_WINDOW_BITS / 64]; // bit seq % SEQ_WINDOW_BITS is set if `seq` was received
+};
+
+/** Arrival statistics of one UDP Packet Train */
+struct train_stats {
+	uint32_t count; // the number of distinct packets of the train received
+	struct timespec t_first; // arrival time of the first received packet
+	struct timespec t_last; // arrival time of the last received packet
+	long busy_ns; // sum of the inter-arrival gaps ending with a packet of the train
+	uint32_t duplicates; // packets whose sequence number was received before
+	uint32_t late; // packets older than the sequence window, not counted
+	uint32_t reordered; // packets that arrived after a packet with a higher sequence number
+	uint32_t max_reorder; // the largest number of sequence numbers a packet arrived behind
+	uint32_t next_seq; // one more than the highest sequence number received
+	uint32_t loss_run; // the length of the run of missing sequence numbers ending at the window base
+	uint32_t loss_runs; // the number of runs of consecutive missing sequence numbers
+	uint32_t longest_loss_run;
+	struct seq_window window;
+	uint32_t blocks; // the number of SPRT_BLOCK packet blocks timed after the first one
+	long block_sum_ns; // the sum of the durations of the timed blocks
+	double block_sq_ns; // the sum of the squared durations of the timed blocks
+	double block_lag_ns; // the sum of the products of the durations of consecutive timed blocks
+	long block_prev_ns; // the duration of the last timed block
+	struct timespec t_block; // arrival time of the last packet of the previous block
+	long busy_block; // `busy_ns` at the end of the previous block
+	struct timespec tx_first; // the TX timestamp of the first received packet
+	long owd_base_ns; // the one-way delay of the first received packet, including the offset of the clocks
+	double owd_mean_x; // the running mean of the send times (ns after `tx_first`)
+	double owd_mean_y; // the running mean of the relative one-way delays (ns above `owd_base_ns`)
+	double owd_m2_x; // the running sums of squared deviations of the send times and the delays
+	double owd_m2_y;
+	double owd_c_xy; // the running sum of their co-deviations
+	long departure_ns; // the departure dispersion of the train the client reported, 0 if it did not
+	uint32_t gap_hist[GAP_HIST_BUCKETS]; // the inter-arrival gaps between the packets of the train (see `gap_bucket`)
+	long gap_min_ns;
+	long gap_max_ns;
+};
+
+/** Decisions of the sequential test */
+#define SPRT_UNDECIDED 0
+#define SPRT_NO_COMPRESSION 1
+#define SPRT_COMPRESSION 2
+
+/** Progress of receiving the UDP Packet Trains of a session */
+struct receive_state {
+	uint32_t received; // the number of packets of the session received so far
+	int complete_trains; // the number of trains whose packets have all been received
+	struct timespec t_prev; // arrival time of the previously received packet of the session
+	int verdict; // the decision of the sequential test (SPRT_*)
+	uint32_t sprt_blocks; // the number of observations of the sequential test
+	double diff_mean; // the running mean of the observations (ns)
+	double diff_m2; // the running sum of squared deviations of the observations
+	double llr; // the log-likelihood ratio of compression against no compression
+	double tau_ns; // the threshold calibrated from the baseline trains, 0 until they are timed
+	double noise_ns; // the standard deviation of the dispersion difference of two trains on the path
+};
+
+/** An estimated quantity with its 95% confidence interval */
+struct estimate {
+	double value;
+	double low;
+	double high; // INFINITY if the data do not bound it
+};
+
+/** Buffers of the recvmmsg receive engine */
+struct mmsg_receiver {
+	int sock; // the UDP socket the packets are read from
+	unsigned char *bufs; // RECV_BATCH_SIZE payload buffers
+	char *controls; // RECV_BATCH_SIZE control buffers, receiving the kernel timestamps
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+};
+
+/** State of the io_uring receive engine: the rings shared with the kernel and the provided buffers */
+struct uring_receiver {
+	int ring_fd; // the io_uring instance, readable when completions are available
+	int sock; // the UDP socket the packets are read from
+	void *sq_ring; // the mapped submission queue ring
+	size_t sq_ring_len;
+	void *cq_ring; // the mapped completion queue ring, the same mapping as `sq_ring` on recent kernels
+	size_t cq_ring_len;
+	struct io_uring_sqe *sqes; // the mapped submission queue entries
+	size_t sqes_len;
+	uint32_t *sq_tail, *sq_mask, *sq_array;
+	uint32_t *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *buf_ring; // the ring the receive buffers are provided to the kernel through
+	size_t buf_ring_len;
+	unsigned char *bufs; // URING_BUF_COUNT receive buffers of `buf_len` bytes
+	size_t bufs_len;
+	uint32_t buf_len;
+	struct msghdr msg; // the template of the multishot recvmsg request: no address, one timestamp cmsg
+};
+
+/** The per-packet arrival trace of a session, kept in a preallocated arena */
+struct arrival_trace {
+	int in_use; // the trace belongs to a receiving session
+	int lock; // spin lock of the thread appending to the trace
+	const char *dir; // the directory the trace is written to when the session ends
+	struct timespec t0; // the time the client was told to send, the base of the first delta
+	struct timespec t_prev; // the arrival time of the last recorded packet
+	uint64_t num_records;
+	size_t used; // the bytes of `arena` holding records
+	int truncated; // set if the arena filled up and later arrivals were not recorded
+	unsigned char *arena; // TRACE_ARENA_SIZE bytes of encoded arrival records
+};
+
+/** Lifecycle of a session slot */
+#define SESSION_FREE 0 // the slot is unused
+#define SESSION_CONFIG 1 // the control channel is accepted, waiting for the configurations
+#define SESSION_PROBING 2 // the client was told to send, receiving the UDP Packet Trains
+#define SESSION_DONE 3 // out of the session table, its result is sent, waiting for the client to read its report and close
+
+/** State of one client session, from accepting its control channel to sending its result */
+struct session {
+	int state; // one of the SESSION_* states
+	int ctrl_sock; // the control channel of the session
+	struct configurations configs;
+	struct train_stats trains[MAX_TRAINS];
+	struct receive_state recv;
+	struct timespec cutoff; // the time (CLOCK_REALTIME) the session ends, even if packets are missing
+	uint32_t arrivals; // the packets counted by all the receive workers, updated atomically
+	struct arrival_trace *trace; // the arrival trace of the session, NULL if it is not traced
+	char ctrl_buf[CTRL_HEADER_LEN + CONFIG_BUF_SIZE]; // the part of the control message received so far
+	uint32_t ctrl_len;
+	long departure_ns[MAX_TRAINS]; // the departure dispersion of each train (CTRL_TX_REPORT), 0 if not timestamped
+	int tx_reports; // the number of CTRL_TX_REPORT messages received
+	char *out; // the CTRL_REPORT message being sent, a buffer of the server, NULL if there is none
+	uint32_t out_len;
+	uint32_t out_sent; // the bytes of `out` the control channel took so far
 };
 
-void serve_pre_probe(uint16_t, char *, int);
+/** A UDP socket receiving the trains of all the sessions sending to its port */
+struct udp_listener {
+	uint16_t port;
+	int engine; // the receive engine (RECV_ENGINE_*) chosen by the session that opened the port
+	struct mmsg_receiver mr;
+	struct uring_receiver ur;
+};
+
+/** The part of the trains of a session received by one receive worker */
+struct session_part {
+	struct train_stats trains[MAX_TRAINS];
+	struct receive_state recv;
+};
+
+struct probe_server;
+
+/** A receive thread, pinned to a core, reading its own SO_REUSEPORT socket of every UDP port */
+struct recv_worker {
+	struct probe_server *server;
+	pthread_t thread;
+	int core; // the CPU the thread is pinned to
+	int epfd; // the epoll instance the UDP sockets of the worker are watched by
+	struct udp_listener listeners[MAX_UDP_PORTS];
+	int num_listeners;
+	struct session_part *parts; // MAX_SESSIONS partial results, indexed by the slot of the session
+};
+
+/** State of the server: the sessions, demultiplexed by their session ID, and the sockets it waits on */
+struct probe_server {
+	int epfd; // the epoll instance all the sockets and the timer are watched by
+	int listen_sock; // the pre-probing TCP listener
+	int timer; // a CLOCK_REALTIME timerfd armed at the earliest deadline of the sessions
+	struct session sessions[MAX_SESSIONS];
+	int session_index[SESSION_HASH_SIZE]; // session ID -> slot in `sessions`, -1 if empty; linear probing
+	struct udp_listener listeners[MAX_UDP_PORTS]; // the UDP sockets, when the main thread receives
+	int num_listeners;
+	struct recv_worker *workers; // the receive workers, NULL when the main thread receives
+	int num_workers;
+	pthread_rwlock_t lock; // held by a worker while it reads packets, by the main thread while it changes the sessions
+	int wake; // an eventfd the workers signal when all the packets of a session arrived
+	int fixed_ports; // set in daemon mode: only the UDP ports opened at startup are served
+	struct arrival_trace *traces; // TRACE_ARENAS traces, NULL if the arrivals are not traced
+	char *free_reports[REPORT_BUFFERS]; // the buffers of CTRL_REPORT messages no session is sending
+	int num_free_reports;
+};
+
+/** How the server is run, from its command line */
+struct server_options {
+	uint16_t preprobing_port;
+	int num_workers; // the number of receive workers, 0 to receive in the main thread
+	int daemon; // detach from the terminal, and serve the pre-opened UDP ports only
+	uint16_t udp_ports[MAX_UDP_PORTS]; // the UDP ports opened at startup
+	int num_udp_ports;
+	int recv_engine; // the receive engine (RECV_ENGINE_*) of the UDP ports opened at startup
+	char *trace_dir; // the directory the arrival traces are written to, NULL to not trace
+};
+
+/** Kinds of the file descriptors watched by the server, kept in the upper half of the epoll data */
+#define EV_LISTEN 1 // the pre-probing listener
+#define EV_CTRL 2 // the control channel of a session, the lower half is its slot
+#define EV_UDP 3 // a UDP listener, the lower half is its index
+#define EV_TIMER 4 // the session deadline timer
+#define EV_WAKE 5 // the eventfd of the receive workers
+
+int parse_configs(char *, struct configurations *);
+
+void watch_fd(int, int, int, uint32_t);
+
+void serve_sessions(struct server_options *);
+
+int open_preprobing_listener(uint16_t);
+
+int receive_config(struct session *, char *, int);
+
+int open_udp_port(struct probe_server *, uint16_t, int);
+
+int drain_udp_listener(struct probe_server *, struct recv_worker *, struct udp_listener *);
+
+void setup_recv_workers(struct probe_server *, int);
+
+void run_recv_workers(struct probe_server *);
+
+void reset_session_parts(struct probe_server *, struct session *);
+
+void collect_session_parts(struct probe_server *, struct session *);
+
+int start_probe(struct session *);
+
+void session_deadline(struct session *, struct timespec *);
+
+void finish_probe(struct session *);
+
+int receive_tx_reports(struct session *);
+
+int probe_complete(struct session *);
+
+void setup_arrival_traces(struct probe_server *, const char *);
+
+struct arrival_trace *acquire_trace(struct probe_server *);
+
+void trace_arrival(struct arrival_trace *, struct configurations *, unsigned char *, int, struct timespec *);
+
+void export_trace(struct arrival_trace *, struct configurations *);
+
+struct session *find_session(struct probe_server *, uint32_t);
+
+void dispatch_packet(struct probe_server *, struct recv_worker *, unsigned char *, int, struct timespec *);
+
+int classify_packet(unsigned char *, int, struct configurations *);
+
+void record_arrival(struct configurations *, struct train_stats *, struct receive_state *, unsigned char *, int, 
+	struct timespec *);
+
+int rx_timestamp(struct msghdr *, struct timespec *);
+
+int setup_uring_receiver(struct uring_receiver *, int, uint32_t);
+
+int drain_uring_receiver(struct uring_receiver *, struct probe_server *, struct recv_worker *);
+
+void close_uring_receiver(struct uring_receiver *);
+
+long train_dispersion_ns(struct configurations *, struct train_stats *);
+
+long train_dispersion(struct configurations *, struct train_stats *);
+
+long path_dispersion_ns(struct configurations *, struct train_stats *);
+
+int estimate_capacity(struct configurations *, struct train_stats *, uint32_t, struct estimate *);
+
+int estimate_delay_trend(struct train_stats *, struct estimate *);
+
+void estimate_compression_ratio(struct estimate *, struct estimate *, struct estimate *);
+
+int gap_bucket(long);
+
+long gap_bucket_low(int);
+
+long gap_percentile(struct train_stats *, double);
+
+void close_seq_window(struct train_stats *, uint32_t);
+
+void find_extreme_trains(struct configurations *, int *, int *);
+
+uint32_t expected_packets(struct configurations *, struct train_stats *, struct receive_state *);
+
+void setup_report_buffers(struct probe_server *);
+
+char *acquire_report_buffer(struct probe_server *);
+
+void release_report_buffer(struct probe_server *, char *);
+
+uint32_t serve_post_probe(int, struct configurations *, struct train_stats *, struct receive_state *, int, char *);
 
-void serve_probe(struct configurations *, int *);
+int flush_report(struct session *);
 
-void serve_post_probe(uint16_t, int);
+int drain_ctrl(struct session *);
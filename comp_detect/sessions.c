@@ -0,0 +1,506 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "server.h"
+#include "probe_header.h"
+
+/** the time (in secs) a client has to send its configurations after connecting */
+#define CONFIG_TIMEOUT 10
+/** the number of events handled per epoll_wait() call */
+#define MAX_EVENTS 64
+
+/** 
+ * This function adds a file descriptor to the epoll instance of the server, to be reported when it is 
+ * readable. The kind of the file descriptor and its index are kept in the epoll data.
+ * 
+ * @param epfd The epoll instance.
+ * @param fd The file descriptor to watch.
+ * @param kind The kind of the file descriptor (EV_*).
+ * @param index The slot of the session or the index of the UDP listener the file descriptor belongs to.
+ * @return void. Exits the program on failure.
+ */
+void watch_fd(int epfd, int fd, int kind, uint32_t index) {
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u64 = ((uint64_t) kind << 32) | index;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		perror("Failed to add file descriptor to epoll");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/** 
+ * This function returns the slot of the session table a session ID starts probing at.
+ */
+uint32_t session_hash(uint32_t session_id) {
+	return (session_id * 2654435761u) & (SESSION_HASH_SIZE - 1);
+}
+
+/** 
+ * This function looks up the session a session ID belongs to.
+ * 
+ * @param server The server.
+ * @param session_id The session ID carried in the probe header.
+ * @return The session, or NULL if no session with this ID is receiving.
+ */
+struct session *find_session(struct probe_server *server, uint32_t session_id) {
+	for (uint32_t h = session_hash(session_id); server->session_index[h] != -1; h = (h + 1) & (SESSION_HASH_SIZE - 1)) {
+		struct session *s = &server->sessions[server->session_index[h]];
+		if (s->configs.session_id == session_id) return s;
+	}
+	return NULL;
+}
+
+/** 
+ * This function adds a session to the session table, keyed by its session ID.
+ * 
+ * @param server The server.
+ * @param slot The slot of the session in `sessions`.
+ * @return 0 on success, or -1 if a session with the same ID is already receiving.
+ */
+int index_session(struct probe_server *server, int slot) {
+	uint32_t session_id = server->sessions[slot].configs.session_id;
+	if (find_session(server, session_id) != NULL) return -1;
+	uint32_t h = session_hash(session_id);
+	while (server->session_index[h] != -1) h = (h + 1) & (SESSION_HASH_SIZE - 1);
+	server->session_index[h] = slot;
+	return 0;
+}
+
+/** 
+ * This function removes a session from the session table. The entries after it in the same probe 
+ * sequence are shifted back, so lookups never stop early at the freed entry.
+ * 
+ * @param server The server.
+ * @param slot The slot of the session in `sessions`.
+ */
+void unindex_session(struct probe_server *server, int slot) {
+	uint32_t mask = SESSION_HASH_SIZE - 1;
+	uint32_t h = session_hash(server->sessions[slot].configs.session_id);
+	while (server->session_index[h] != slot) {
+		if (server->session_index[h] == -1) return;
+		h = (h + 1) & mask;
+	}
+
+	server->session_index[h] = -1;
+	for (uint32_t next = (h + 1) & mask; server->session_index[next] != -1; next = (next + 1) & mask) {
+		int moved = server->session_index[next];
+		uint32_t home = session_hash(server->sessions[moved].configs.session_id);
+		// the entry may only move back to `h` if `h` lies between its home slot and its current slot
+		if (((next - home) & mask) >= ((next - h) & mask)) {
+			server->session_index[h] = moved;
+			server->session_index[next] = -1;
+			h = next;
+		}
+	}
+}
+
+/** 
+ * This function takes the write lock of the server if it has receive workers. The lock only guards the 
+ * session table and the partial results of the workers: a worker reaches a session through the table 
+ * only, so a session out of the table is the main thread's alone.
+ * 
+ * @param server The server.
+ */
+void lock_sessions(struct probe_server *server) {
+	if (server->num_workers > 0) pthread_rwlock_wrlock(&server->lock);
+}
+
+/** 
+ * This function releases the write lock taken by `lock_sessions`.
+ * 
+ * @param server The server.
+ */
+void unlock_sessions(struct probe_server *server) {
+	if (server->num_workers > 0) pthread_rwlock_unlock(&server->lock);
+}
+
+/** 
+ * This function ends a session: it closes its control channel and frees its slot.
+ * 
+ * @param server The server.
+ * @param s The session.
+ */
+void release_session(struct probe_server *server, struct session *s) {
+	if (s->state == SESSION_PROBING) {
+		lock_sessions(server);
+		unindex_session(server, s - server->sessions);
+		unlock_sessions(server);
+	}
+	if (s->trace != NULL) {
+		s->trace->in_use = 0;
+		s->trace = NULL;
+	}
+	if (s->out != NULL) {
+		release_report_buffer(server, s->out);
+		s->out = NULL;
+	}
+	close(s->ctrl_sock); // also removes it from the epoll instance
+	s->state = SESSION_FREE;
+}
+
+/** 
+ * This function moves on a session whose result was sent: it discards what the client still sends on 
+ * the control channel, e.g. the departures of a train it sent before the sequential test stopped it, 
+ * and sends more of the report. Once the report is out, the server closes its side of the control 
+ * channel and waits for the client to close its own: closing a socket with unread data resets the 
+ * connection, which can discard the result before the client read it. The session ends once the 
+ * client closed the control channel, or REPORT_TIMEOUT after its result.
+ * 
+ * @param server The server.
+ * @param s The session, in SESSION_DONE.
+ */
+void serve_done_session(struct probe_server *server, struct session *s) {
+	if (drain_ctrl(s) != 0 || flush_report(s) == -1) {
+		release_session(server, s);
+		return;
+	}
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	if (s->out_sent < s->out_len) {
+		event.events |= EPOLLOUT;
+	} else if (shutdown(s->ctrl_sock, SHUT_WR) == -1) {
+		release_session(server, s);
+		return;
+	}
+	event.data.u64 = ((uint64_t) EV_CTRL << 32) | (uint32_t) (s - server->sessions);
+	if (epoll_ctl(server->epfd, EPOLL_CTL_MOD, s->ctrl_sock, &event) == -1) {
+		perror("Failed to watch the control channel");
+		release_session(server, s);
+	}
+}
+
+/** 
+ * This function ends a receiving session with its result. The session leaves the session table 
+ * first, so its result is sent and its trace written without holding the lock the workers wait on. 
+ * The session then stays until the client read its report and closed the control channel, or 
+ * REPORT_TIMEOUT passed.
+ * 
+ * @param server The server.
+ * @param s The session.
+ */
+void complete_session(struct probe_server *server, struct session *s) {
+	lock_sessions(server);
+	unindex_session(server, s - server->sessions);
+	unlock_sessions(server);
+	s->state = SESSION_DONE;
+	if (s->configs.report) s->out = acquire_report_buffer(server);
+	finish_probe(s);
+	clock_gettime(CLOCK_REALTIME, &s->cutoff);
+	s->cutoff.tv_sec += REPORT_TIMEOUT;
+	serve_done_session(server, s);
+}
+
+/** 
+ * This function accepts the pending pre-probing connections. Each one gets a free session slot and 
+ * waits for its configurations; if all the slots are in use, the connection is closed.
+ * 
+ * @param server The server.
+ */
+void accept_sessions(struct probe_server *server) {
+	while (1) {
+		int client_sock = accept(server->listen_sock, NULL, NULL); //don't need client's IP addr
+		if (client_sock == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("Failed to accept connection");
+			if (errno == EINTR) continue;
+			return;
+		}
+
+		int slot = 0;
+		while (slot < MAX_SESSIONS && server->sessions[slot].state != SESSION_FREE) slot++;
+		if (slot == MAX_SESSIONS) {
+			printf("Too many sessions, refusing a client\n");
+			close(client_sock);
+			continue;
+		}
+
+		struct session *s = &server->sessions[slot];
+		memset(s, 0, sizeof(struct session));
+		s->state = SESSION_CONFIG;
+		s->ctrl_sock = client_sock;
+		clock_gettime(CLOCK_REALTIME, &s->cutoff);
+		s->cutoff.tv_sec += CONFIG_TIMEOUT;
+		watch_fd(server->epfd, client_sock, EV_CTRL, slot);
+	}
+}
+
+/** 
+ * This function handles data or a closed connection on the control channel of a session. Once the 
+ * configurations of a waiting session are complete, they are parsed, the session is indexed by its 
+ * session ID, the UDP listener of its port is opened if needed, and the client is told to start 
+ * sending. A probing session may report the departures of its trains, which can complete it. A 
+ * session that closes its control channel before its result is sent is dropped. A session whose 
+ * result was sent is handed to `serve_done_session`.
+ * 
+ * @param server The server.
+ * @param s The session.
+ */
+void handle_ctrl(struct probe_server *server, struct session *s) {
+	if (s->state == SESSION_DONE) {
+		serve_done_session(server, s);
+		return;
+	}
+	if (s->state == SESSION_PROBING) {
+		if (receive_tx_reports(s) == -1) {
+			printf("Client of session %u left before its result\n", s->configs.session_id);
+			release_session(server, s);
+		} else if (server->num_workers == 0 && probe_complete(s)) {
+			// with receive workers, the session is completed once their parts are collected
+			complete_session(server, s);
+		}
+		return;
+	}
+
+	char buffer[CONFIG_BUF_SIZE];
+	int result = receive_config(s, buffer, CONFIG_BUF_SIZE);
+	if (result == 0) return;
+	if (result == -1 || parse_configs(buffer, &s->configs) == -1) {
+		release_session(server, s);
+		return;
+	}
+
+	// the configurations are parsed before the session enters the table, so no worker sees them change
+	lock_sessions(server);
+	int result_index = index_session(server, s - server->sessions);
+	int result_port = 0;
+	if (result_index == 0) {
+		s->state = SESSION_PROBING;
+		s->ctrl_len = 0; // the control buffer now receives the reports of the departures
+		reset_session_parts(server, s);
+		result_port = open_udp_port(server, s->configs.udp_dst_port, s->configs.recv_engine);
+		s->trace = acquire_trace(server);
+	}
+	unlock_sessions(server);
+
+	if (result_index == -1) {
+		printf("Session %u is already running, refusing a client\n", s->configs.session_id);
+		release_session(server, s);
+		return;
+	}
+	if (result_port == -1 || start_probe(s) == -1) release_session(server, s);
+}
+
+/** 
+ * This function hands a received UDP packet to the session its probe header names, and ends the 
+ * session once all the packets of its trains have arrived or its sequential test decided. Packets of 
+ * unknown sessions are dropped. A receive worker only adds the packet to its partial result of the 
+ * session, and wakes up the main thread when a train starts, so its idle deadline is armed, and to end 
+ * the session once the workers together counted all its packets or its sequential test decided.
+ * 
+ * @param server The server.
+ * @param worker The receive worker that read the packet, or NULL for the main thread.
+ * @param buf The received payload.
+ * @param len The length of the received payload.
+ * @param ts The arrival time of the packet.
+ */
+void dispatch_packet(struct probe_server *server, struct recv_worker *worker, unsigned char *buf, int len, 
+	struct timespec *ts) {
+	if (len < (int) PROBE_HEADER_LEN) return;
+	struct probe_header *header = (struct probe_header *) buf;
+	if (header->version != PROBE_VERSION) return;
+	struct session *s = find_session(server, ntohl(header->session_id));
+	if (s == NULL) return;
+
+	if (worker != NULL) {
+		struct session_part *part = &worker->parts[s - server->sessions];
+		uint32_t received = part->recv.received;
+		int verdict = part->recv.verdict;
+		record_arrival(&s->configs, part->trains, &part->recv, buf, len, ts);
+		if (s->trace != NULL) trace_arrival(s->trace, &s->configs, buf, len, ts);
+		if (part->recv.received == received) return;
+
+		// the main thread follows the idle deadline from the start of every train on, and ends the 
+		// session once all its packets arrived or the sequential test decided
+		uint32_t arrivals = __atomic_add_fetch(&s->arrivals, 1, __ATOMIC_RELAXED);
+		if (part->trains[ntohs(header->train_id)].count == 1 || arrivals == s->configs.n * s->configs.num_trains || 
+			part->recv.verdict != verdict) {
+			uint64_t one = 1;
+			if (write(server->wake, &one, sizeof(one)) == -1) perror("Failed to wake up the server");
+		}
+		return;
+	}
+
+	record_arrival(&s->configs, s->trains, &s->recv, buf, len, ts);
+	if (s->trace != NULL) trace_arrival(s->trace, &s->configs, buf, len, ts);
+	if (probe_complete(s)) complete_session(server, s);
+}
+
+/** 
+ * This function ends the sessions whose deadline has passed: a session still waiting for its 
+ * configurations is dropped, a receiving session gets its result with the packets received so far, 
+ * and a session whose client does not read its report is dropped along with the rest of the report. 
+ * With receive workers, the partial results of each receiving session are merged first, and the 
+ * sessions whose packets all arrived, or whose sequential test decided, get their result as well. The timer of the server is then 
+ * armed at the earliest deadline of the remaining sessions.
+ * 
+ * @param server The server.
+ */
+void expire_sessions(struct probe_server *server) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	struct itimerspec next;
+	memset(&next, 0, sizeof(next));
+
+	for (int slot = 0; slot < MAX_SESSIONS; slot++) {
+		struct session *s = &server->sessions[slot];
+		if (s->state == SESSION_FREE) continue;
+
+		if (s->state == SESSION_PROBING && server->num_workers > 0) {
+			lock_sessions(server);
+			collect_session_parts(server, s);
+			unlock_sessions(server);
+			if (probe_complete(s)) complete_session(server, s);
+			if (s->state == SESSION_FREE) continue;
+		}
+
+		struct timespec deadline = s->cutoff;
+		if (s->state == SESSION_PROBING) session_deadline(s, &deadline);
+		if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+			if (s->state == SESSION_PROBING) {
+				// the remaining packets are lost
+				complete_session(server, s);
+			} else {
+				if (s->state == SESSION_DONE && s->out_sent < s->out_len) {
+					printf("Client of session %u did not read its report in time\n", s->configs.session_id);
+				}
+				release_session(server, s);
+			}
+			if (s->state == SESSION_FREE) continue;
+			deadline = s->cutoff;
+		}
+		if ((next.it_value.tv_sec == 0 && next.it_value.tv_nsec == 0) || deadline.tv_sec < next.it_value.tv_sec || 
+			(deadline.tv_sec == next.it_value.tv_sec && deadline.tv_nsec < next.it_value.tv_nsec)) {
+			next.it_value = deadline;
+		}
+	}
+
+	// a zero value disarms the timer when no session is left
+	if (timerfd_settime(server->timer, TFD_TIMER_ABSTIME, &next, NULL) == -1) {
+		perror("Failed to arm timer");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/** 
+ * This function runs the server: it accepts pre-probing connections on its pre-probing port and serves 
+ * any number of sessions at the same time, up to MAX_SESSIONS. A single thread sleeps in `epoll_wait` 
+ * on the pre-probing listener, the control channels, the UDP listeners and a timer; UDP packets are 
+ * demultiplexed to their session by the session ID of their probe header. With receive workers, the 
+ * UDP sockets are read by the workers instead, and the main thread takes the write lock of the server 
+ * only while it changes the session table or the partial results of the workers, so the workers never 
+ * see a session change halfway; the control messages and the traces are written without it. 
+ * 
+ * All the memory of the sessions is allocated once at startup, and the UDP ports given on the command 
+ * line are opened before the first client connects. In daemon mode, the server then detaches from the 
+ * terminal, locks its memory and only serves those ports, so a session neither allocates memory nor 
+ * sets up a socket besides accepting its control channel. This function never returns.
+ * 
+ * @param options The command line options of the server.
+ */
+void serve_sessions(struct server_options *options) {
+	// detach first: the io_uring requests and the threads of the server belong to the process that 
+	// creates them, and do not survive the fork. stdout is kept, so the log can be redirected to a file
+	if (options->daemon) {
+		if (daemon(0, 1) == -1) {
+			perror("Failed to detach from the terminal");
+			exit(EXIT_FAILURE);
+		}
+		setvbuf(stdout, NULL, _IOLBF, 0);
+	}
+
+	struct probe_server *server = calloc(1, sizeof(struct probe_server));
+	if (server == NULL) {
+		perror("Failed to allocate memory for the sessions");
+		exit(EXIT_FAILURE);
+	}
+	memset(server->session_index, -1, sizeof(server->session_index));
+
+	server->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (server->epfd == -1) {
+		perror("Failed to create epoll instance");
+		exit(EXIT_FAILURE);
+	}
+	server->timer = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (server->timer == -1) {
+		perror("Failed to create timer");
+		exit(EXIT_FAILURE);
+	}
+	server->listen_sock = open_preprobing_listener(options->preprobing_port);
+	watch_fd(server->epfd, server->listen_sock, EV_LISTEN, 0);
+	watch_fd(server->epfd, server->timer, EV_TIMER, 0);
+
+	// the workers hold the read lock most of the time, let the main thread in first
+	pthread_rwlockattr_t lock_attr;
+	pthread_rwlockattr_init(&lock_attr);
+	pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&server->lock, &lock_attr);
+	if (options->num_workers > 0) {
+		server->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (server->wake == -1) {
+			perror("Failed to create eventfd");
+			exit(EXIT_FAILURE);
+		}
+		watch_fd(server->epfd, server->wake, EV_WAKE, 0);
+		setup_recv_workers(server, options->num_workers);
+	}
+
+	for (int i = 0; i < options->num_udp_ports; i++) {
+		if (open_udp_port(server, options->udp_ports[i], options->recv_engine) == -1) exit(EXIT_FAILURE);
+	}
+
+	if (options->trace_dir != NULL) setup_arrival_traces(server, options->trace_dir);
+	setup_report_buffers(server);
+
+	if (options->daemon) {
+		server->fixed_ports = 1;
+		// the pools are faulted in now rather than during the first sessions
+		if (mlockall(MCL_CURRENT) == -1) perror("Failed to lock the memory of the server");
+	}
+	run_recv_workers(server);
+
+	struct epoll_event events[MAX_EVENTS];
+	while (1) {
+		int ready = epoll_wait(server->epfd, events, MAX_EVENTS, -1);
+		if (ready == -1) {
+			if (errno == EINTR) continue;
+			perror("Failed to wait for events");
+			exit(EXIT_FAILURE);
+		}
+
+		for (int e = 0; e < ready; e++) {
+			int kind = events[e].data.u64 >> 32;
+			uint32_t index = (uint32_t) events[e].data.u64;
+			if (kind == EV_LISTEN) {
+				accept_sessions(server);
+			} else if (kind == EV_CTRL) {
+				// the session may have ended earlier in this round
+				if (server->sessions[index].state != SESSION_FREE) handle_ctrl(server, &server->sessions[index]);
+			} else if (kind == EV_UDP) {
+				if (drain_udp_listener(server, NULL, &server->listeners[index]) == -1) exit(EXIT_FAILURE);
+			} else if (kind == EV_TIMER || kind == EV_WAKE) {
+				uint64_t expirations;
+				int fd = kind == EV_TIMER ? server->timer : server->wake;
+				if (read(fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+					perror("Failed to read timer");
+				}
+			}
+		}
+
+		expire_sessions(server);
+	}
+}
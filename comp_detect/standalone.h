@@ -1,5 +1,14 @@
 #include <stdint.h>
+#include <stddef.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <linux/if_packet.h>
 #define ADDR_LEN 32
+#define MAC_STR_LEN 18
+#define IPH_ID 54321 //IP header identifier for SYN packets
+#define SYN_TTL 64   //TTL for SYN packets
 
 struct configurations {
 	char server_ip_addr[ADDR_LEN];
@@ -14,6 +23,42 @@ struct configurations {
 	uint16_t gamma; // inter-measurement time, γ
 	uint16_t tau; // threshold of time diff (in millis) between low and high entropy data
     uint16_t ttl; // TTL for the UDP Packets, used to trace the location of compression link 
+	uint32_t session_id; // tags the UDP Packets of this run in their probe header
+	int send_mode; // the engine handing the UDP Packet Train to the kernel (SEND_MODE_*)
+	uint32_t batch_size; // the Number of Packets handed to the kernel per send syscall
+	double rate_pps; // the Rate (packets per second) the UDP Packet Train is paced at, 0 for unpaced
+	int pacing; // the method used to pace the UDP Packet Train (PACING_*)
+	int tx_ring; // send SYN, UDP Packet Train and SYN from one pre-built PACKET_MMAP TX ring
+	char ifname[IFNAMSIZ]; // the interface the TX ring sends on, looked up in the ARP table if empty
+	char next_hop_mac[MAC_STR_LEN]; // the MAC address the TX ring frames are sent to, looked up if empty
+};
+
+/** A PACKET_MMAP TX ring holding the frames of one measurement */
+struct tx_ring {
+	int fd; // the AF_PACKET socket owning the ring
+	unsigned char *map; // the mapped ring
+	size_t map_len;
+	uint32_t frame_size;
+	uint32_t frame_nr;
+	uint32_t head; // the frame the kernel sends next, its index persists across sends
+	uint32_t filled; // the number of frames of the measurement written from `head` on
+	struct sockaddr_ll addr; // the interface the frames are sent on
+	unsigned char src_mac[ETH_ALEN];
+	unsigned char dst_mac[ETH_ALEN];
 };
 
 void probe(struct configurations *);
+
+unsigned short csum(unsigned short *, int);
+
+int populate_ip_header(struct ip *, struct configurations *, int, int);
+
+void populate_tcp_header(struct tcphdr *, struct ip *, uint16_t, uint16_t);
+
+int setup_tx_ring(struct tx_ring *, struct configurations *);
+
+void fill_tx_ring(struct tx_ring *, struct configurations *, unsigned char *);
+
+int flush_tx_ring(struct tx_ring *);
+
+void close_tx_ring(struct tx_ring *);
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "payload_generator.h"
+
+/** Number of random bytes compressed in one piece, far more than the zlib window */
+#define RANDOM_SAMPLE_SIZE (1 << 20)
+/** Size of the payloads compressed one by one, like a link compresses every packet */
+#define PAYLOAD_SIZE 1000
+/** Number of payloads of every entropy level compressed */
+#define PAYLOADS_PER_LEVEL 256
+/** Margin the compression ratio of a graded payload may stay below its share of random bytes */
+#define GRADE_MARGIN 0.05
+
+/**
+ * This function compresses a buffer with zlib at its best compression level.
+ *
+ * @param ptr The buffer to compress.
+ * @param size The number of bytes in the buffer.
+ * @return The compressed size over `size`.
+ */
+double zlib_ratio(unsigned char *ptr, size_t size) {
+	uLongf compressed_len = compressBound(size);
+	unsigned char *compressed = malloc(compressed_len);
+	if (compressed == NULL || compress2(compressed, &compressed_len, ptr, size, Z_BEST_COMPRESSION) != Z_OK) {
+		printf("Failed to compress %zu bytes with zlib\n", size);
+		exit(EXIT_FAILURE);
+	}
+	free(compressed);
+	return (double) compressed_len / size;
+}
+
+/**
+ * This function compresses PAYLOADS_PER_LEVEL payloads of an entropy level one by one.
+ *
+ * @param entropy_level The entropy level of the payloads (0 to 100, or ENTROPY_TEXT).
+ * @return The mean compressed size over the payload size.
+ */
+double payload_ratio(int entropy_level) {
+	double sum = 0;
+	for (int i = 0; i < PAYLOADS_PER_LEVEL; i++) {
+		unsigned char *payload = generate_payload(PAYLOAD_SIZE, entropy_level);
+		fill_probe_header(payload, 1, 0, entropy_level);
+		fill_packet_id(payload, i);
+		sum += zlib_ratio(payload, PAYLOAD_SIZE);
+		free(payload);
+	}
+	return sum / PAYLOADS_PER_LEVEL;
+}
+
+/**
+ * This program checks the payload generator against a real compressor: the output of the random
+ * generator must not shrink under zlib, and payloads of entropy level p must not shrink below
+ * their p% of random bytes, while low entropy and text-like payloads must compress well.
+ *
+ * @return EXIT_SUCCESS if every check passes, EXIT_FAILURE otherwise.
+ */
+int main(void) {
+	int failed = 0;
+
+	unsigned char *sample = malloc(RANDOM_SAMPLE_SIZE);
+	if (sample == NULL) {
+		perror("Failed to allocate memory for the random sample");
+		return EXIT_FAILURE;
+	}
+	generate_random_bytes(sample, RANDOM_SAMPLE_SIZE);
+	double ratio = zlib_ratio(sample, RANDOM_SAMPLE_SIZE);
+	free(sample);
+	printf("%s: random generator, %d bytes, zlib ratio %.4f\n", ratio >= 1 ? "PASS" : "FAIL", RANDOM_SAMPLE_SIZE, ratio);
+	failed |= ratio < 1;
+
+	int levels[] = { ENTROPY_LOW, 25, 50, 75, ENTROPY_HIGH };
+	for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+		ratio = payload_ratio(levels[i]);
+		// the random bytes of a payload cannot be compressed, the probe header and the zeroes can
+		double min_ratio = levels[i] > ENTROPY_LOW ? levels[i] / 100.0 - GRADE_MARGIN : 0;
+		int pass = ratio >= min_ratio && (levels[i] != ENTROPY_LOW || ratio < 0.1);
+		printf("%s: %d%% random payloads, zlib ratio %.4f (at least %.2f)\n", pass ? "PASS" : "FAIL", levels[i], ratio, min_ratio);
+		failed |= !pass;
+	}
+
+	ratio = payload_ratio(ENTROPY_TEXT);
+	printf("%s: text payloads, zlib ratio %.4f (below 0.6)\n", ratio < 0.6 ? "PASS" : "FAIL", ratio);
+	failed |= ratio >= 0.6;
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
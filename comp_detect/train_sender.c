@@ -0,0 +1,909 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+#include "train_sender.h"
+#include "payload_generator.h"
+
+/** 
+ * This function returns the time elapsed from `start` to `end` in nanoseconds.
+ * 
+ * @param start The earlier timestamp.
+ * @param end The later timestamp.
+ * @return The elapsed time in nanoseconds.
+ */
+long elapsed_ns(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+/** 
+ * This function tells whether the receiver asked to end the train early.
+ * 
+ * @param stop The flag set by the thread watching the receiver, or NULL.
+ * @return 1 if the rest of the train must not be sent, 0 otherwise.
+ */
+int train_stopped(int *stop) {
+	return stop != NULL && __atomic_load_n(stop, __ATOMIC_RELAXED);
+}
+
+/** 
+ * This function maps the `send_mode` config string to one of the SEND_MODE_* engines.
+ * 
+ * @param mode The name of the send engine: "sendto", "mmsg", "gso" or "zerocopy".
+ * @return The SEND_MODE_* value, or -1 if the name is unknown.
+ */
+int parse_send_mode(const char *mode) {
+	if (strcmp(mode, "sendto") == 0) {
+		return SEND_MODE_SENDTO;
+	} else if (strcmp(mode, "mmsg") == 0) {
+		return SEND_MODE_MMSG;
+	} else if (strcmp(mode, "gso") == 0) {
+		return SEND_MODE_GSO;
+	} else if (strcmp(mode, "zerocopy") == 0) {
+		return SEND_MODE_ZEROCOPY;
+	} else {
+		return -1;
+	}
+}
+
+/** 
+ * This function maps the `pacing` config string to one of the PACING_* methods.
+ * 
+ * @param pacing The name of the pacing method: "bucket" or "txtime".
+ * @return The PACING_* value, or -1 if the name is unknown.
+ */
+int parse_pacing(const char *pacing) {
+	if (strcmp(pacing, "bucket") == 0) {
+		return PACING_BUCKET;
+	} else if (strcmp(pacing, "txtime") == 0) {
+		return PACING_TXTIME;
+	} else {
+		return -1;
+	}
+}
+
+/** 
+ * This function decides whether a failed send should be retried. A send failing with ENOBUFS 
+ * means the qdisc or device queue is momentarily full, so instead of giving up the whole train 
+ * the sender backs off, doubling the wait from ENOBUFS_BACKOFF_MIN_US up to ENOBUFS_BACKOFF_MAX_US, 
+ * and retries up to MAX_ENOBUFS_RETRIES times in a row.
+ * 
+ * @param attempt The number of consecutive retries so far, reset by the caller after a successful send.
+ * @param report Its `enobufs_retries` counts all the retries of the train, or NULL.
+ * @return 1 if the send should be retried, 0 otherwise.
+ */
+int backoff_on_enobufs(uint32_t *attempt, struct train_report *report) {
+	if (errno != ENOBUFS || *attempt >= MAX_ENOBUFS_RETRIES) return 0;
+
+	long backoff_us = ENOBUFS_BACKOFF_MIN_US;
+	for (uint32_t i = 0; i < *attempt && backoff_us < ENOBUFS_BACKOFF_MAX_US; i++) {
+		backoff_us *= 2;
+	}
+	if (backoff_us > ENOBUFS_BACKOFF_MAX_US) backoff_us = ENOBUFS_BACKOFF_MAX_US;
+	struct timespec wait = { .tv_sec = 0, .tv_nsec = backoff_us * 1000L };
+	nanosleep(&wait, NULL);
+	(*attempt)++;
+	if (report != NULL) report->enobufs_retries++;
+	return 1;
+}
+
+/** 
+ * This function turns on the reporting of TX timestamps on a socket. The software timestamps and the 
+ * raw hardware timestamps (if the NIC has timestamping enabled, e.g. by ptp4l) of the sends that ask 
+ * for them with `request_tx_timestamp` are queued to the socket error queue, without a copy of the 
+ * packet.
+ * 
+ * @param sock The UDP socket the trains are sent on.
+ * @return 0 on success, or -1 if the kernel does not support SO_TIMESTAMPING.
+ */
+int enable_tx_timestamps(int sock) {
+	uint32_t flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+	return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+/** 
+ * This function tells whether the TX timestamps of a packet are requested: only those of the first 
+ * and the last packet of the train, so the error queue never holds more than a few of them.
+ * 
+ * @param timestamps Whether the TX timestamps of the train are requested at all.
+ * @param id The ID of the packet.
+ * @param n The number of packets in the train.
+ * @return 1 if the send of the packet must request its TX timestamps, 0 otherwise.
+ */
+int wants_tx_timestamp(int timestamps, uint32_t id, uint32_t n) {
+	return timestamps && (id == 0 || id == n - 1);
+}
+
+/** 
+ * This function makes a send request its software and hardware TX timestamps: it appends an 
+ * SO_TIMESTAMPING control message to `msg`. A message without control data gets `control` as its 
+ * control buffer; one with control data must have TX_TSTAMP_CONTROL_LEN bytes free after it.
+ * 
+ * @param msg The message of the send.
+ * @param control A buffer of TX_TSTAMP_CONTROL_LEN bytes, used if `msg` has no control data yet.
+ */
+void request_tx_timestamp(struct msghdr *msg, char *control) {
+	if (msg->msg_controllen == 0) msg->msg_control = control;
+	struct cmsghdr *cm = (struct cmsghdr *) ((char *) msg->msg_control + msg->msg_controllen);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SO_TIMESTAMPING;
+	cm->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+	uint32_t flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_HARDWARE;
+	memcpy(CMSG_DATA(cm), &flags, sizeof(flags));
+	msg->msg_controllen += TX_TSTAMP_CONTROL_LEN;
+}
+
+/** 
+ * This function widens the span of the TX timestamps of one clock by `ts`.
+ * 
+ * @param first The earliest timestamp of the clock so far.
+ * @param last The latest timestamp of the clock so far.
+ * @param count The number of timestamps of the clock so far, incremented.
+ * @param ts The new timestamp.
+ */
+void widen_tx_span(struct timespec *first, struct timespec *last, uint32_t *count, struct timespec *ts) {
+	if (*count == 0 || ts->tv_sec < first->tv_sec || (ts->tv_sec == first->tv_sec && ts->tv_nsec < first->tv_nsec)) {
+		*first = *ts;
+	}
+	if (*count == 0 || ts->tv_sec > last->tv_sec || (ts->tv_sec == last->tv_sec && ts->tv_nsec > last->tv_nsec)) {
+		*last = *ts;
+	}
+	(*count)++;
+}
+
+/** 
+ * This function adds the TX timestamps carried by a message read from the socket error queue to the 
+ * report of the train. Messages without timestamps, such as zero-copy completions, are ignored.
+ * 
+ * @param msg The message read from the error queue.
+ * @param report Its software and hardware timestamp spans are widened by the timestamps of `msg`.
+ */
+void record_tx_timestamps(struct msghdr *msg, struct train_report *report) {
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_TIMESTAMPING) continue;
+		struct scm_timestamping tss;
+		memcpy(&tss, CMSG_DATA(cm), sizeof(tss));
+		// ts[0] is the software timestamp, ts[2] the raw hardware one, zero when not taken
+		if (tss.ts[0].tv_sec != 0 || tss.ts[0].tv_nsec != 0) {
+			widen_tx_span(&report->sw_first, &report->sw_last, &report->sw_stamps, &tss.ts[0]);
+		}
+		if (tss.ts[2].tv_sec != 0 || tss.ts[2].tv_nsec != 0) {
+			widen_tx_span(&report->hw_first, &report->hw_last, &report->hw_stamps, &tss.ts[2]);
+		}
+	}
+}
+
+/** 
+ * This function reads the TX timestamps of a train from the socket error queue. The kernel queues 
+ * them shortly after the packets left, so it waits up to TX_TSTAMP_WAIT_MS for the software 
+ * timestamps of all the `requested` packets, and for their hardware timestamps if the NIC takes any.
+ * 
+ * @param sock The UDP socket the train was sent on.
+ * @param requested The number of sent packets that requested their TX timestamps.
+ * @param report The report of the train, receiving the timestamps.
+ */
+void collect_tx_timestamps(int sock, uint32_t requested, struct train_report *report) {
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (report->sw_stamps < requested || (report->hw_stamps > 0 && report->hw_stamps < requested)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long wait_ms = TX_TSTAMP_WAIT_MS - elapsed_ns(&start, &now) / 1000000L;
+		if (wait_ms <= 0) return;
+		struct pollfd pfd = { .fd = sock, .events = 0 }; // error queue readiness is always reported as POLLERR
+		if (poll(&pfd, 1, wait_ms) == -1) {
+			perror("Failed to wait for TX timestamps");
+			return;
+		}
+
+		while (1) {
+			char control[256];
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) break;
+			record_tx_timestamps(&msg, report);
+		}
+	}
+}
+
+/** 
+ * This function sends packets `first` to `n - 1` of the train with one `sendto` per packet, 
+ * rewriting the packet ID of the single payload buffer before every send.
+ * 
+ * @return 0 on success, or -1 if an error occurred while sending the packets.
+ */
+int send_train_sendto(int sock, struct sockaddr_in *dst, unsigned char *payload, uint32_t l, 
+	uint32_t first, uint32_t n, int *stop, int timestamps, struct train_report *report) {
+	uint32_t attempt = 0;
+	struct timespec tx;
+	// the first and the last packet go out with `sendmsg`, to carry their timestamp request
+	struct iovec iov = { .iov_base = payload, .iov_len = l };
+	union {
+		char buf[TX_TSTAMP_CONTROL_LEN];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = dst;
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	request_tx_timestamp(&msg, control.buf);
+
+	for (uint32_t i = first; i < n && !train_stopped(stop); i++) {
+		fill_packet_id(payload, i);
+		clock_gettime(CLOCK_REALTIME, &tx);
+		fill_tx_timestamp(payload, &tx);
+		int count = wants_tx_timestamp(timestamps, i, n) ? sendmsg(sock, &msg, 0) : 
+			sendto(sock, payload, l, 0, (struct sockaddr *) dst, sizeof(struct sockaddr_in));
+		if (count == -1) {
+			if (backoff_on_enobufs(&attempt, report)) {
+				i--;
+				continue;
+			}
+			perror("Failed to send UDP packet");
+			return -1;
+		}
+		attempt = 0;
+		report->sent++;
+		report->syscalls++;
+	}
+	return 0;
+}
+
+/** 
+ * This function sends packets `first` to `n - 1` of the train in batches with `sendmmsg`. A batch 
+ * of `batch_size` copies of the payload is prepared once, and only the packet IDs are rewritten 
+ * before each batch goes out, so the train costs n / batch_size syscalls instead of n.
+ * 
+ * @return 0 on success, or -1 if an error occurred while sending the packets.
+ */
+int send_train_mmsg(int sock, struct sockaddr_in *dst, unsigned char *payload, uint32_t l, 
+	uint32_t first, uint32_t n, uint32_t batch_size, int *stop, int timestamps, struct train_report *report) {
+	unsigned char *slots = malloc((size_t) batch_size * l);
+	struct mmsghdr *msgs = calloc(batch_size, sizeof(struct mmsghdr));
+	struct iovec *iovs = calloc(batch_size, sizeof(struct iovec));
+	char *controls = calloc(batch_size, TX_TSTAMP_CONTROL_LEN);
+	if (slots == NULL || msgs == NULL || iovs == NULL || controls == NULL) {
+		perror("Failed to allocate memory for the send batch");
+		free(slots);
+		free(msgs);
+		free(iovs);
+		free(controls);
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < batch_size; i++) {
+		memcpy(slots + (size_t) i * l, payload, l);
+		iovs[i].iov_base = slots + (size_t) i * l;
+		iovs[i].iov_len = l;
+		msgs[i].msg_hdr.msg_name = dst;
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int result = 0;
+	uint32_t attempt = 0;
+	uint32_t next_id = first;
+	struct timespec tx;
+	while (next_id < n && !train_stopped(stop)) {
+		uint32_t vlen = n - next_id < batch_size ? n - next_id : batch_size;
+		clock_gettime(CLOCK_REALTIME, &tx);
+		for (uint32_t i = 0; i < vlen; i++) {
+			fill_packet_id(slots + (size_t) i * l, next_id + i);
+			fill_tx_timestamp(slots + (size_t) i * l, &tx);
+			msgs[i].msg_hdr.msg_controllen = 0;
+			if (wants_tx_timestamp(timestamps, next_id + i, n)) {
+				request_tx_timestamp(&msgs[i].msg_hdr, controls + (size_t) i * TX_TSTAMP_CONTROL_LEN);
+			}
+		}
+
+		// sendmmsg may accept only part of the batch, keep going until the whole batch is out
+		uint32_t done = 0;
+		while (done < vlen) {
+			int count = sendmmsg(sock, msgs + done, vlen - done, 0);
+			if (count == -1) {
+				if (backoff_on_enobufs(&attempt, report)) continue;
+				perror("Failed to send UDP packets");
+				result = -1;
+				goto out;
+			}
+			attempt = 0;
+			done += count;
+			report->sent += count;
+			report->syscalls++;
+		}
+		next_id += vlen;
+	}
+
+out:
+	free(slots);
+	free(msgs);
+	free(iovs);
+	free(controls);
+	return result;
+}
+
+/** 
+ * This function sends the packet train with UDP generic segmentation offload. Up to `segments` 
+ * payloads, each carrying its own packet ID, are laid out back to back in one super-buffer, 
+ * and the kernel splits it into `l` sized datagrams, so one `sendmsg` puts a whole block of 
+ * the train on the wire.
+ * 
+ * @param next_id Set to the ID of the first packet not sent, so the caller can fall back to 
+ *                another engine when the kernel or the device rejects UDP GSO.
+ * 
+ * @return 0 on success, 1 if UDP GSO is not available, or -1 if an error occurred while sending.
+ */
+int send_train_gso(int sock, struct sockaddr_in *dst, unsigned char *payload, uint32_t l, 
+	uint32_t n, uint32_t segments, uint32_t *next_id, int *stop, int timestamps, struct train_report *report) {
+	*next_id = 0;
+	int gso_size = l;
+	if (setsockopt(sock, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) == -1) {
+		return 1;
+	}
+
+	unsigned char *super_buf = malloc((size_t) segments * l);
+	if (super_buf == NULL) {
+		perror("Failed to allocate memory for the GSO buffer");
+		return -1;
+	}
+	for (uint32_t i = 0; i < segments; i++) {
+		memcpy(super_buf + (size_t) i * l, payload, l);
+	}
+
+	struct iovec iov;
+	union {
+		char buf[TX_TSTAMP_CONTROL_LEN];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = dst;
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	iov.iov_base = super_buf;
+
+	int result = 0;
+	uint32_t attempt = 0;
+	struct timespec tx;
+	while (*next_id < n && !train_stopped(stop)) {
+		uint32_t count = n - *next_id < segments ? n - *next_id : segments;
+		clock_gettime(CLOCK_REALTIME, &tx);
+		for (uint32_t i = 0; i < count; i++) {
+			fill_packet_id(super_buf + (size_t) i * l, *next_id + i);
+			fill_tx_timestamp(super_buf + (size_t) i * l, &tx);
+		}
+		// the timestamps of a super-buffer are those of its first segment
+		msg.msg_controllen = 0;
+		if (wants_tx_timestamp(timestamps, *next_id, n) || wants_tx_timestamp(timestamps, *next_id + count - 1, n)) {
+			request_tx_timestamp(&msg, control.buf);
+		}
+		iov.iov_len = (size_t) count * l;
+		if (sendmsg(sock, &msg, 0) == -1) {
+			if (backoff_on_enobufs(&attempt, report)) continue;
+			// EIO: the egress device cannot checksum GSO segments; EINVAL: rejected by the stack
+			if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT) {
+				result = 1;
+			} else {
+				perror("Failed to send UDP GSO buffer");
+				result = -1;
+			}
+			break;
+		}
+		attempt = 0;
+		*next_id += count;
+		report->sent += count;
+		report->syscalls++;
+	}
+
+	// Turn segmentation off again, so later sends on the socket are plain datagrams
+	gso_size = 0;
+	setsockopt(sock, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size));
+	free(super_buf);
+	return result;
+}
+
+/** 
+ * This function reaps MSG_ZEROCOPY completion notifications from the socket error queue. Each 
+ * notification covers a range of zero-copy sends whose buffers the kernel no longer references. 
+ * The TX timestamps found on the way are added to the report.
+ * 
+ * @param sock The UDP socket the zero-copy sends were issued on.
+ * @param completed Incremented by the number of sends covered by the reaped notifications.
+ * @param report Its `zerocopy_copied` is incremented for sends the kernel completed by copying, and 
+ *               its TX timestamp spans are widened.
+ * @param block If set, waits until at least one notification is available.
+ * 
+ * @return 0 on success, or -1 if reading the error queue failed.
+ */
+int reap_zerocopy_completions(int sock, uint32_t *completed, struct train_report *report, int block) {
+	if (block) {
+		struct pollfd pfd = { .fd = sock, .events = 0 }; // error queue readiness is always reported as POLLERR
+		if (poll(&pfd, 1, -1) == -1) {
+			perror("Failed to wait for zero-copy completions");
+			return -1;
+		}
+	}
+
+	while (1) {
+		char control[128];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			perror("Failed to read zero-copy completions");
+			return -1;
+		}
+		record_tx_timestamps(&msg, report);
+
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) continue;
+			struct sock_extended_err *serr = (struct sock_extended_err *) CMSG_DATA(cm);
+			if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+			// [ee_info, ee_data] is the inclusive range of completed sends
+			uint32_t range = serr->ee_data - serr->ee_info + 1;
+			*completed += range;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) report->zerocopy_copied += range;
+		}
+	}
+}
+
+/** 
+ * This function sends the packet train with MSG_ZEROCOPY out of a pre-built payload ring. All 
+ * payloads of the train (or a ring of ZEROCOPY_RING_SLOTS of them) are laid out with their IDs 
+ * pre-filled by `build_payload_ring`, and batches of them are passed to `sendmmsg` by reference, 
+ * so the kernel does not copy the payload. A ring slot is only rewritten with a later packet ID 
+ * once the completion of its previous send has been reaped from the socket error queue.
+ * 
+ * @return 0 on success, 1 if MSG_ZEROCOPY is not available, or -1 if an error occurred while sending.
+ */
+int send_train_zerocopy(int sock, struct sockaddr_in *dst, unsigned char *payload, uint32_t l, 
+	uint32_t n, uint32_t batch_size, int *stop, int timestamps, struct train_report *report) {
+	int one = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+		return 1;
+	}
+
+	uint32_t slots = n < ZEROCOPY_RING_SLOTS ? n : ZEROCOPY_RING_SLOTS;
+	if (batch_size > slots) batch_size = slots;
+	size_t arena_len;
+	unsigned char *ring = build_payload_ring(payload, l, slots, &arena_len);
+	struct mmsghdr *msgs = calloc(batch_size, sizeof(struct mmsghdr));
+	struct iovec *iovs = calloc(batch_size, sizeof(struct iovec));
+	char *controls = calloc(batch_size, TX_TSTAMP_CONTROL_LEN);
+	if (msgs == NULL || iovs == NULL || controls == NULL) {
+		perror("Failed to allocate memory for the send batch");
+		free(msgs);
+		free(iovs);
+		free(controls);
+		free_payload_ring(ring, arena_len);
+		return -1;
+	}
+	for (uint32_t i = 0; i < batch_size; i++) {
+		iovs[i].iov_len = l;
+		msgs[i].msg_hdr.msg_name = dst;
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	// Notifications of a single UDP flow complete in order, so a count of completed sends is enough
+	int result = 0;
+	uint32_t attempt = 0;
+	uint32_t next_id = 0, completed = 0;
+	struct timespec tx;
+	while (next_id < n && !train_stopped(stop)) {
+		uint32_t vlen = n - next_id < batch_size ? n - next_id : batch_size;
+		// The slots of this batch must not be referenced by earlier sends any more
+		while (next_id + vlen > completed + slots) {
+			if (reap_zerocopy_completions(sock, &completed, report, 1) == -1) {
+				result = -1;
+				goto out;
+			}
+		}
+		clock_gettime(CLOCK_REALTIME, &tx);
+		for (uint32_t i = 0; i < vlen; i++) {
+			uint32_t id = next_id + i;
+			unsigned char *slot = ring + (size_t) (id % slots) * l;
+			if (id >= slots) fill_packet_id(slot, id);
+			fill_tx_timestamp(slot, &tx);
+			iovs[i].iov_base = slot;
+			msgs[i].msg_hdr.msg_controllen = 0;
+			if (wants_tx_timestamp(timestamps, id, n)) {
+				request_tx_timestamp(&msgs[i].msg_hdr, controls + (size_t) i * TX_TSTAMP_CONTROL_LEN);
+			}
+		}
+
+		uint32_t done = 0;
+		while (done < vlen) {
+			int count = sendmmsg(sock, msgs + done, vlen - done, MSG_ZEROCOPY);
+			if (count == -1) {
+				// Too many outstanding zero-copy sends: wait for completions and try again
+				if (errno == ENOBUFS && completed < report->sent) {
+					if (reap_zerocopy_completions(sock, &completed, report, 1) == -1) {
+						result = -1;
+						goto out;
+					}
+					continue;
+				}
+				if (backoff_on_enobufs(&attempt, report)) continue;
+				perror("Failed to send UDP packets with MSG_ZEROCOPY");
+				result = -1;
+				goto out;
+			}
+			attempt = 0;
+			done += count;
+			report->sent += count;
+			report->syscalls++;
+		}
+		next_id += vlen;
+		if (reap_zerocopy_completions(sock, &completed, report, 0) == -1) {
+			result = -1;
+			goto out;
+		}
+	}
+
+out:
+	// The ring can only be released once the kernel is done with all of it
+	while (completed < report->sent) {
+		if (reap_zerocopy_completions(sock, &completed, report, 1) == -1) break;
+	}
+	free(msgs);
+	free(iovs);
+	free(controls);
+	free_payload_ring(ring, arena_len);
+	return result;
+}
+
+/** 
+ * This function sends the packet train at `rate_pps` packets per second, so that the i-th packet 
+ * leaves at t0 + i / rate_pps. With PACING_BUCKET, a token bucket of depth `batch_size` releases 
+ * the packets that are due and sleeps until the next ones are. With PACING_TXTIME, every packet 
+ * carries its departure time in an SCM_TXTIME control message and the fq qdisc holds it until 
+ * then; the sender stays at most one batch ahead of the schedule, so fq never buffers more than 
+ * a batch of the train.
+ * 
+ * @return 0 on success, or -1 if an error occurred while sending the packets.
+ */
+int send_train_paced(int sock, struct sockaddr_in *dst, unsigned char *payload, uint32_t l, 
+	uint32_t n, uint32_t batch_size, double rate_pps, int pacing, int *stop, int timestamps, struct train_report *report) {
+	if (pacing == PACING_TXTIME) {
+		struct sock_txtime txtime_cfg = { .clockid = CLOCK_MONOTONIC, .flags = 0 };
+		if (setsockopt(sock, SOL_SOCKET, SO_TXTIME, &txtime_cfg, sizeof(txtime_cfg)) == -1) {
+			printf("SO_TXTIME is unavailable, pacing the train with a token bucket\n");
+			pacing = PACING_BUCKET;
+		}
+	}
+
+	unsigned char *slots = malloc((size_t) batch_size * l);
+	struct mmsghdr *msgs = calloc(batch_size, sizeof(struct mmsghdr));
+	struct iovec *iovs = calloc(batch_size, sizeof(struct iovec));
+	// room for the departure time and the timestamp request of every packet
+	size_t control_len = CMSG_SPACE(sizeof(uint64_t)) + TX_TSTAMP_CONTROL_LEN;
+	char *controls = calloc(batch_size, control_len);
+	if (slots == NULL || msgs == NULL || iovs == NULL || controls == NULL) {
+		perror("Failed to allocate memory for the send batch");
+		free(slots);
+		free(msgs);
+		free(iovs);
+		free(controls);
+		return -1;
+	}
+	for (uint32_t i = 0; i < batch_size; i++) {
+		memcpy(slots + (size_t) i * l, payload, l);
+		iovs[i].iov_base = slots + (size_t) i * l;
+		iovs[i].iov_len = l;
+		msgs[i].msg_hdr.msg_name = dst;
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		if (pacing == PACING_TXTIME) {
+			msgs[i].msg_hdr.msg_control = controls + i * control_len;
+			msgs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint64_t));
+			struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type = SCM_TXTIME;
+			cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+		}
+	}
+
+	double gap_ns = 1e9 / rate_pps;
+	// how far ahead of the schedule packets may be handed to the kernel
+	long lead_ns = pacing == PACING_TXTIME ? (long) (gap_ns * batch_size) : 0;
+	struct timespec t0, now, tx;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	uint64_t t0_ns = t0.tv_sec * 1000000000ULL + t0.tv_nsec;
+	// with SO_TXTIME, a packet is stamped with its departure time, taken to CLOCK_REALTIME
+	clock_gettime(CLOCK_REALTIME, &tx);
+	int64_t realtime_offset_ns = (tx.tv_sec * 1000000000LL + tx.tv_nsec) - (int64_t) t0_ns;
+
+	int result = 0;
+	uint32_t attempt = 0;
+	uint32_t next_id = 0;
+	while (next_id < n && !train_stopped(stop)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long since_ns = elapsed_ns(&t0, &now) + lead_ns;
+		// packets 0 .. due - 1 are due by now
+		uint64_t due = (uint64_t) (since_ns / gap_ns) + 1;
+		if (due > n) due = n;
+		if (due <= next_id) {
+			uint64_t wake_ns = t0_ns + (uint64_t) (next_id * gap_ns) - lead_ns;
+			struct timespec wake = { .tv_sec = wake_ns / 1000000000ULL, .tv_nsec = wake_ns % 1000000000ULL };
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+			continue;
+		}
+
+		uint32_t vlen = due - next_id < batch_size ? due - next_id : batch_size;
+		clock_gettime(CLOCK_REALTIME, &tx);
+		for (uint32_t i = 0; i < vlen; i++) {
+			fill_packet_id(slots + (size_t) i * l, next_id + i);
+			if (pacing == PACING_TXTIME) {
+				uint64_t txtime = t0_ns + (uint64_t) ((next_id + i) * gap_ns);
+				memcpy(CMSG_DATA(CMSG_FIRSTHDR(&msgs[i].msg_hdr)), &txtime, sizeof(txtime));
+				int64_t departure_ns = (int64_t) txtime + realtime_offset_ns;
+				tx.tv_sec = departure_ns / 1000000000LL;
+				tx.tv_nsec = departure_ns % 1000000000LL;
+			}
+			fill_tx_timestamp(slots + (size_t) i * l, &tx);
+			msgs[i].msg_hdr.msg_controllen = pacing == PACING_TXTIME ? CMSG_SPACE(sizeof(uint64_t)) : 0;
+			if (wants_tx_timestamp(timestamps, next_id + i, n)) {
+				request_tx_timestamp(&msgs[i].msg_hdr, controls + i * control_len);
+			}
+		}
+
+		uint32_t done = 0;
+		while (done < vlen) {
+			int count = sendmmsg(sock, msgs + done, vlen - done, 0);
+			if (count == -1) {
+				if (backoff_on_enobufs(&attempt, report)) continue;
+				perror("Failed to send paced UDP packets");
+				result = -1;
+				goto out;
+			}
+			attempt = 0;
+			done += count;
+			report->sent += count;
+			report->syscalls++;
+		}
+		next_id += vlen;
+	}
+
+out:
+	free(slots);
+	free(msgs);
+	free(iovs);
+	free(controls);
+	return result;
+}
+
+/** 
+ * This function sends a UDP packet train of `n` packets with `l` bytes payload to `dst`. Every packet
+ * carries the `payload` content with its own packet ID filled by `fill_packet_id`, and the time it 
+ * was handed to the kernel by `fill_tx_timestamp` (shared by the packets of a batch). Depending on 
+ * `opts`, the train goes out with one `sendto` per packet, in `sendmmsg` batches, in UDP GSO 
+ * super-buffers, or in MSG_ZEROCOPY batches out of a pre-built payload ring. When UDP GSO or 
+ * MSG_ZEROCOPY is unavailable, the train falls back to `sendmmsg`. When a rate is configured, the 
+ * train is paced by `send_train_paced` instead. Sends failing with ENOBUFS are retried after a 
+ * backoff rather than aborting the train. Once `opts->stop` is set, the rest of the train is not sent.
+ * The achieved packet rate and the train duration are stored in `report`, along with the TX 
+ * timestamps of the first and the last packet if `opts->tx_timestamps` is set.
+ * 
+ * @param sock The UDP socket descriptor used to send the packets.
+ * @param dst The destination address of the train.
+ * @param payload The payload template, whose packet ID field is overwritten for every packet.
+ * @param l The size of the UDP payload of each packet.
+ * @param n The number of packets in the train.
+ * @param opts The options selecting the send engine.
+ * @param report The structure where the sender side statistics of the train are stored.
+ * 
+ * @return 0 on success, or -1 if an error occurred while sending the packets.
+ */
+int send_train(int sock, struct sockaddr_in *dst, unsigned char *payload, uint32_t l, uint32_t n, 
+	struct send_options *opts, struct train_report *report) {
+	memset(report, 0, sizeof(struct train_report));
+	uint32_t batch_size = opts->batch_size;
+	if (batch_size < 1) batch_size = 1;
+	if (batch_size > MAX_BATCH_SIZE) batch_size = MAX_BATCH_SIZE;
+
+	struct timespec t_start, t_end;
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	int result = 0;
+	if (opts->rate_pps > 0) {
+		result = send_train_paced(sock, dst, payload, l, n, batch_size, opts->rate_pps, opts->pacing, opts->stop, 
+			opts->tx_timestamps, report);
+	} else {
+		uint32_t first = 0;
+		int mode = opts->mode;
+		if (mode == SEND_MODE_GSO) {
+			uint32_t segments = batch_size;
+			if (segments > MAX_GSO_SEGMENTS) segments = MAX_GSO_SEGMENTS;
+			if (segments > MAX_GSO_BYTES / l) segments = MAX_GSO_BYTES / l;
+
+			result = segments < 2 ? 1 : send_train_gso(sock, dst, payload, l, n, segments, &first, opts->stop, 
+				opts->tx_timestamps, report);
+			if (result == 1) {
+				printf("UDP GSO is unavailable, sending the rest of the train with sendmmsg\n");
+				mode = SEND_MODE_MMSG;
+			}
+		}
+		if (mode == SEND_MODE_ZEROCOPY) {
+			result = send_train_zerocopy(sock, dst, payload, l, n, batch_size, opts->stop, opts->tx_timestamps, report);
+			if (result == 1) {
+				printf("MSG_ZEROCOPY is unavailable, sending the train with sendmmsg\n");
+				mode = SEND_MODE_MMSG;
+			}
+		}
+		if (mode == SEND_MODE_SENDTO) {
+			result = send_train_sendto(sock, dst, payload, l, first, n, opts->stop, opts->tx_timestamps, report);
+		} else if (mode == SEND_MODE_MMSG) {
+			result = send_train_mmsg(sock, dst, payload, l, first, n, batch_size, opts->stop, opts->tx_timestamps, report);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+
+	report->duration_ns = elapsed_ns(&t_start, &t_end);
+	if (report->duration_ns > 0) {
+		report->pps = report->sent * 1e9 / report->duration_ns;
+	}
+	if (opts->tx_timestamps && result == 0 && report->sent > 0) {
+		// the last packet only requested its timestamps if the train was sent in full
+		collect_tx_timestamps(sock, report->sent == n && n > 1 ? 2 : 1, report);
+	}
+	return result;
+}
+
+/** 
+ * This function sends `num_trains` packet trains interleaved in one continuous stream instead of 
+ * one after another: `block` consecutive packets of train 0 are followed by the same packet IDs 
+ * of train 1, and so on, before the next block of every train. Each packet goes out as two 
+ * iovecs, its own probe header and the payload body of its train shared by all its packets, in 
+ * `sendmmsg` batches. When `rate_pps` is set, the whole stream is paced by a token bucket. Once 
+ * `opts->stop` is set, the rest of the stream is not sent.
+ * 
+ * @param sock The UDP socket descriptor used to send the packets.
+ * @param dst The destination address of the trains.
+ * @param payloads The payload template of each train, with its probe header filled.
+ * @param num_trains The number of trains interleaved in the stream.
+ * @param l The size of the UDP payload of each packet.
+ * @param n The number of packets in each train.
+ * @param block The number of consecutive packets of a train in the stream.
+ * @param opts The options giving the batch size and the pacing rate.
+ * @param report The structure where the sender side statistics of the stream are stored.
+ * 
+ * @return 0 on success, or -1 if an error occurred while sending the packets.
+ */
+int send_interleaved_trains(int sock, struct sockaddr_in *dst, unsigned char **payloads, uint16_t num_trains, 
+	uint32_t l, uint32_t n, uint32_t block, struct send_options *opts, struct train_report *report) {
+	memset(report, 0, sizeof(struct train_report));
+	uint32_t batch_size = opts->batch_size;
+	if (batch_size < 1) batch_size = 1;
+	if (batch_size > MAX_BATCH_SIZE) batch_size = MAX_BATCH_SIZE;
+	if (block < 1) block = 1;
+
+	unsigned char *headers = malloc((size_t) batch_size * PROBE_HEADER_LEN);
+	struct mmsghdr *msgs = calloc(batch_size, sizeof(struct mmsghdr));
+	struct iovec *iovs = calloc((size_t) batch_size * 2, sizeof(struct iovec));
+	if (headers == NULL || msgs == NULL || iovs == NULL) {
+		perror("Failed to allocate memory for the send batch");
+		free(headers);
+		free(msgs);
+		free(iovs);
+		return -1;
+	}
+	for (uint32_t i = 0; i < batch_size; i++) {
+		iovs[2 * i].iov_base = headers + (size_t) i * PROBE_HEADER_LEN;
+		iovs[2 * i].iov_len = PROBE_HEADER_LEN;
+		iovs[2 * i + 1].iov_len = l - PROBE_HEADER_LEN;
+		msgs[i].msg_hdr.msg_name = dst;
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = &iovs[2 * i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	double gap_ns = opts->rate_pps > 0 ? 1e9 / opts->rate_pps : 0;
+	uint64_t total = (uint64_t) n * num_trains;
+	struct timespec t_start, t_end, now, tx;
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	uint64_t t0_ns = t_start.tv_sec * 1000000000ULL + t_start.tv_nsec;
+
+	int result = 0;
+	uint32_t attempt = 0;
+	uint64_t next = 0; // the position in the stream of the next packet
+	// position of the next packet: train `train`, packet `block_start + offset`
+	uint32_t block_start = 0, offset = 0;
+	uint16_t train = 0;
+	while (next < total && !train_stopped(opts->stop)) {
+		uint64_t due = total;
+		if (gap_ns > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			due = (uint64_t) (elapsed_ns(&t_start, &now) / gap_ns) + 1;
+			if (due > total) due = total;
+			if (due <= next) {
+				uint64_t wake_ns = t0_ns + (uint64_t) (next * gap_ns);
+				struct timespec wake = { .tv_sec = wake_ns / 1000000000ULL, .tv_nsec = wake_ns % 1000000000ULL };
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+				continue;
+			}
+		}
+
+		uint32_t vlen = due - next < batch_size ? due - next : batch_size;
+		clock_gettime(CLOCK_REALTIME, &tx);
+		for (uint32_t i = 0; i < vlen; i++) {
+			unsigned char *header = headers + (size_t) i * PROBE_HEADER_LEN;
+			memcpy(header, payloads[train], PROBE_HEADER_LEN);
+			fill_packet_id(header, block_start + offset);
+			fill_tx_timestamp(header, &tx);
+			iovs[2 * i + 1].iov_base = payloads[train] + PROBE_HEADER_LEN;
+
+			// the last block of the trains is shorter when `block` does not divide `n`
+			uint32_t block_len = n - block_start < block ? n - block_start : block;
+			if (++offset == block_len) {
+				offset = 0;
+				if (++train == num_trains) {
+					train = 0;
+					block_start += block;
+				}
+			}
+		}
+
+		uint32_t done = 0;
+		while (done < vlen) {
+			int count = sendmmsg(sock, msgs + done, vlen - done, 0);
+			if (count == -1) {
+				if (backoff_on_enobufs(&attempt, report)) continue;
+				perror("Failed to send interleaved UDP packets");
+				result = -1;
+				goto out;
+			}
+			attempt = 0;
+			done += count;
+			report->sent += count;
+			report->syscalls++;
+		}
+		next += vlen;
+	}
+
+out:
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+	report->duration_ns = elapsed_ns(&t_start, &t_end);
+	if (report->duration_ns > 0) {
+		report->pps = report->sent * 1e9 / report->duration_ns;
+	}
+	free(headers);
+	free(msgs);
+	free(iovs);
+	return result;
+}
+
+/** 
+ * This function prints the sender side statistics of a packet train.
+ * 
+ * @param label The name of the train printed in front of the statistics.
+ * @param report The statistics of the train.
+ */
+void print_train_report(const char *label, struct train_report *report) {
+	printf("%s: sent %u packets in %.3f ms with %u syscalls (%.0f pps)\n", label, report->sent, 
+		report->duration_ns / 1e6, report->syscalls, report->pps);
+	if (report->enobufs_retries > 0) {
+		printf("%s: retried %u sends after ENOBUFS\n", label, report->enobufs_retries);
+	}
+	if (report->zerocopy_copied > 0) {
+		printf("%s: the kernel copied %u of the zero-copy sends\n", label, report->zerocopy_copied);
+	}
+}
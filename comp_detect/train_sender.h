@@ -0,0 +1,80 @@
+#ifndef TRAIN_SENDER_H
+#define TRAIN_SENDER_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/** Upper bound of packets handed to the kernel by one sendmmsg() call */
+#define MAX_BATCH_SIZE 1024
+/** Upper bound of segments the kernel accepts in one UDP GSO super-buffer */
+#define MAX_GSO_SEGMENTS 64
+/** Upper bound of the UDP payload carried by one UDP GSO super-buffer */
+#define MAX_GSO_BYTES 65507
+/** Number of payloads in the pre-built ring used by MSG_ZEROCOPY sends */
+#define ZEROCOPY_RING_SLOTS 4096
+
+/** Send engines, selected by the `send_mode` config */
+#define SEND_MODE_SENDTO 0 // one sendto() per packet
+#define SEND_MODE_MMSG 1 // batches of packets per sendmmsg()
+#define SEND_MODE_GSO 2 // one UDP_SEGMENT super-buffer per sendmsg(), segmented by the kernel
+#define SEND_MODE_ZEROCOPY 3 // sendmmsg() batches with MSG_ZEROCOPY out of a pre-built payload ring
+
+/** Pacing methods, selected by the `pacing` config */
+#define PACING_BUCKET 0 // token bucket in user space, sleeping until the next packets are due
+#define PACING_TXTIME 1 // SO_TXTIME departure time on every packet, enforced by the fq qdisc
+
+/** IPv4 and UDP header bytes added on the wire to every UDP payload */
+#define UDP_IP_OVERHEAD 28
+/** Number of times a send failing with ENOBUFS is retried before the train is given up */
+#define MAX_ENOBUFS_RETRIES 100
+/** Initial and maximal wait before a send failing with ENOBUFS is retried, in microseconds */
+#define ENOBUFS_BACKOFF_MIN_US 50
+#define ENOBUFS_BACKOFF_MAX_US 10000
+/** How long the TX timestamps of a train are waited for in the socket error queue, in milliseconds */
+#define TX_TSTAMP_WAIT_MS 100
+/** The control buffer space a send requesting its TX timestamps needs */
+#define TX_TSTAMP_CONTROL_LEN CMSG_SPACE(sizeof(uint32_t))
+
+/** Options controlling how a packet train is handed to the kernel */
+struct send_options {
+	int mode; // one of the SEND_MODE_* engines
+	uint32_t batch_size; // number of datagrams per sendmmsg() call, or segments per GSO super-buffer
+	double rate_pps; // packets per second the train is paced at, 0 sends as fast as possible
+	int pacing; // one of the PACING_* methods, used when `rate_pps` is set
+	int *stop; // set by another thread to end the train early, NULL if the train is always sent in full
+	int tx_timestamps; // request the TX timestamps of the first and the last packet of the train
+};
+
+/** Statistics of one transmitted packet train, as seen by the sender */
+struct train_report {
+	uint32_t sent; // the number of packets accepted by the kernel
+	uint32_t syscalls; // the number of send syscalls issued for the train
+	long duration_ns; // time between handing the first and the last packet to the kernel
+	double pps; // achieved packets per second
+	uint32_t zerocopy_copied; // zero-copy sends the kernel completed by copying the data anyway
+	uint32_t enobufs_retries; // sends retried after the kernel ran out of buffer space
+	uint32_t sw_stamps; // software TX timestamps read from the error queue
+	struct timespec sw_first; // the earliest and the latest of them
+	struct timespec sw_last;
+	uint32_t hw_stamps; // hardware TX timestamps read from the error queue
+	struct timespec hw_first;
+	struct timespec hw_last;
+};
+
+int parse_send_mode(const char *);
+
+int parse_pacing(const char *);
+
+int enable_tx_timestamps(int);
+
+int backoff_on_enobufs(uint32_t *, struct train_report *);
+
+int send_train(int, struct sockaddr_in *, unsigned char *, uint32_t, uint32_t, 
+	struct send_options *, struct train_report *);
+
+int send_interleaved_trains(int, struct sockaddr_in *, unsigned char **, uint16_t, uint32_t, uint32_t, 
+	uint32_t, struct send_options *, struct train_report *);
+
+void print_train_report(const char *, struct train_report *);
+
+#endif
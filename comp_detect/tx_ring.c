@@ -0,0 +1,330 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+
+#include "standalone.h"
+#include "payload_generator.h"
+#include "train_sender.h"
+
+#define ARP_TABLE "/proc/net/arp"
+#define UDP_IPH_ID 12345 //IP header identifier of the first UDP packet in the ring
+
+/** Offset of the frame data from the start of a TPACKET_V2 frame */
+#define TX_FRAME_DATA_OFFSET (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+/** 
+ * This function parses a MAC address of the form "aa:bb:cc:dd:ee:ff".
+ * 
+ * @param str The MAC address string.
+ * @param mac The buffer of ETH_ALEN bytes the address is stored in.
+ * @return 0 on success, or -1 if the string is not a MAC address.
+ */
+int parse_mac(const char *str, unsigned char *mac) {
+	unsigned int b[ETH_ALEN];
+	if (sscanf(str, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != ETH_ALEN) {
+		return -1;
+	}
+	for (int i = 0; i < ETH_ALEN; i++) mac[i] = b[i];
+	return 0;
+}
+
+/** 
+ * This function finds the interface and the MAC address of the next hop towards the server. 
+ * The `ifname` and `next_hop_mac` configs are used when set; otherwise the server's entry in 
+ * the kernel ARP table is used, which works when the server is on the local link.
+ * 
+ * @param configs The configuration structure containing the server IP addr and the optional overrides.
+ * @param ifname The buffer of IFNAMSIZ bytes the interface name is stored in.
+ * @param mac The buffer of ETH_ALEN bytes the next hop MAC address is stored in.
+ * @return 0 on success, or -1 if the next hop cannot be determined.
+ */
+int find_next_hop(struct configurations *configs, char *ifname, unsigned char *mac) {
+	if (configs->ifname[0] != '\0' && configs->next_hop_mac[0] != '\0') {
+		snprintf(ifname, IFNAMSIZ, "%s", configs->ifname);
+		return parse_mac(configs->next_hop_mac, mac);
+	}
+
+	FILE *fp = fopen(ARP_TABLE, "r");
+	if (fp == NULL) {
+		perror("Unable to open the ARP table");
+		return -1;
+	}
+	char line[256], ip[64], hw[64], dev[IFNAMSIZ];
+	int found = -1;
+	fgets(line, sizeof(line), fp); // skip the header line
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%63s %*s %*s %63s %*s %15s", ip, hw, dev) != 3) continue;
+		if (strcmp(ip, configs->server_ip_addr) == 0 && parse_mac(hw, mac) == 0) {
+			snprintf(ifname, IFNAMSIZ, "%s", configs->ifname[0] != '\0' ? configs->ifname : dev);
+			found = 0;
+			break;
+		}
+	}
+	fclose(fp);
+	if (found == -1) {
+		printf("No ARP entry for %s, set ifname and next_hop_mac to use the TX ring\n", configs->server_ip_addr);
+	}
+	return found;
+}
+
+/** 
+ * This function creates an AF_PACKET socket with a PACKET_MMAP TX ring large enough to hold a 
+ * whole measurement: the head SYN, the n UDP packets and the tail SYN, one frame each. The ring 
+ * is rounded up to whole blocks, so it may have more frames than a measurement uses.
+ * 
+ * @param ring The TX ring to set up.
+ * @param configs The configuration structure containing the packet size and count.
+ * @return 0 on success, or -1 if the ring cannot be set up (e.g. missing privileges or memory).
+ */
+int setup_tx_ring(struct tx_ring *ring, struct configurations *configs) {
+	memset(ring, 0, sizeof(struct tx_ring));
+	char ifname[IFNAMSIZ] = {0};
+	if (find_next_hop(configs, ifname, ring->dst_mac) == -1) {
+		return -1;
+	}
+
+	ring->fd = socket(AF_PACKET, SOCK_RAW, 0); // protocol 0: the socket only transmits
+	if (ring->fd == -1) {
+		perror("Packet socket creation failed");
+		return -1;
+	}
+
+	// Get the source MAC address and the index of the interface
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+	if (ioctl(ring->fd, SIOCGIFHWADDR, &ifr) == -1) {
+		perror("Failed to get the interface MAC address");
+		close(ring->fd);
+		return -1;
+	}
+	memcpy(ring->src_mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	ring->addr.sll_family = AF_PACKET;
+	ring->addr.sll_protocol = htons(ETH_P_IP);
+	ring->addr.sll_ifindex = if_nametoindex(ifname);
+	if (ring->addr.sll_ifindex == 0 || 
+		bind(ring->fd, (struct sockaddr *) &ring->addr, sizeof(ring->addr)) == -1) {
+		perror("Failed to bind the packet socket to the interface");
+		close(ring->fd);
+		return -1;
+	}
+
+	int version = TPACKET_V2;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+		perror("Failed to set the packet socket version");
+		close(ring->fd);
+		return -1;
+	}
+
+	// Frames are a power of two, so they tile the page-sized blocks without gaps
+	uint32_t needed = TX_FRAME_DATA_OFFSET + sizeof(struct ether_header) + sizeof(struct ip) + 
+		sizeof(struct udphdr) + configs->l;
+	ring->frame_size = TPACKET_ALIGNMENT;
+	while (ring->frame_size < needed) ring->frame_size *= 2;
+	uint32_t block_size = sysconf(_SC_PAGESIZE);
+	if (block_size < ring->frame_size) block_size = ring->frame_size;
+	uint32_t frames_per_block = block_size / ring->frame_size;
+
+	struct tpacket_req req;
+	req.tp_block_size = block_size;
+	req.tp_block_nr = (configs->n + 2 + frames_per_block - 1) / frames_per_block;
+	req.tp_frame_size = ring->frame_size;
+	req.tp_frame_nr = req.tp_block_nr * frames_per_block;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) == -1) {
+		perror("Failed to set up the TX ring");
+		close(ring->fd);
+		return -1;
+	}
+	ring->frame_nr = req.tp_frame_nr;
+	ring->map_len = (size_t) req.tp_block_size * req.tp_block_nr;
+	ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		perror("Failed to map the TX ring");
+		close(ring->fd);
+		return -1;
+	}
+	return 0;
+}
+
+/** 
+ * This function fixes up an IP header populated by `populate_ip_header` for a frame that bypasses 
+ * the IP layer: the total length must be in network order, the TTL and ID are set per packet, 
+ * and the checksum is computed over the final header.
+ */
+void finish_ip_header(struct ip *iphr, int data_size, int ttl, uint16_t id) {
+	iphr->ip_len = htons(iphr->ip_hl * 4 + data_size);
+	iphr->ip_ttl = ttl;
+	iphr->ip_id = htons(id);
+	iphr->ip_sum = 0;
+	iphr->ip_sum = csum((unsigned short *) iphr, sizeof(struct ip) >> 1);
+}
+
+/** 
+ * This function computes the UDP checksum of a datagram over the IPv4 pseudo header, 
+ * the UDP header and the payload.
+ * 
+ * @param iphr The IP header of the datagram.
+ * @param udphr The UDP header of the datagram, followed by the payload.
+ * @param udp_len The length of the UDP header and payload.
+ * @return The UDP checksum in network byte order.
+ */
+uint16_t udp_checksum(struct ip *iphr, struct udphdr *udphr, int udp_len) {
+	uint32_t sum = 0;
+	uint16_t *p = (uint16_t *) &iphr->ip_src;
+	for (int i = 0; i < 4; i++) sum += p[i]; // source and destination addresses
+	sum += htons(IPPROTO_UDP);
+	sum += htons(udp_len);
+
+	p = (uint16_t *) udphr;
+	for (int i = 0; i < udp_len / 2; i++) sum += p[i];
+	if (udp_len & 1) sum += htons(((unsigned char *) udphr)[udp_len - 1] << 8);
+
+	while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+	uint16_t result = ~sum;
+	return result == 0 ? 0xffff : result;
+}
+
+/** 
+ * This function returns the TPACKET_V2 header of the i-th frame of the ring. The frame data 
+ * follows the header at TX_FRAME_DATA_OFFSET.
+ */
+struct tpacket2_hdr *tx_frame(struct tx_ring *ring, uint32_t i) {
+	return (struct tpacket2_hdr *) (ring->map + (size_t) i * ring->frame_size);
+}
+
+/** 
+ * This function writes an Ethernet header followed by a SYN packet to `server_port` into `frame`.
+ * 
+ * @return The length of the frame.
+ */
+uint32_t build_SYN_frame(struct tx_ring *ring, struct configurations *configs, unsigned char *frame, uint16_t server_port) {
+	struct ether_header *eth = (struct ether_header *) frame;
+	memcpy(eth->ether_dhost, ring->dst_mac, ETH_ALEN);
+	memcpy(eth->ether_shost, ring->src_mac, ETH_ALEN);
+	eth->ether_type = htons(ETHERTYPE_IP);
+
+	struct ip *iphr = (struct ip *) (frame + sizeof(struct ether_header));
+	populate_ip_header(iphr, configs, IPPROTO_TCP, sizeof(struct tcphdr));
+	finish_ip_header(iphr, sizeof(struct tcphdr), SYN_TTL, IPH_ID);
+	struct tcphdr *tcphr = (struct tcphdr *) ((unsigned char *) iphr + sizeof(struct ip));
+	populate_tcp_header(tcphr, iphr, configs->client_port_SYN, server_port);
+	return sizeof(struct ether_header) + sizeof(struct ip) + sizeof(struct tcphdr);
+}
+
+/** 
+ * This function writes an Ethernet header followed by a UDP packet with packet ID `packet_id` 
+ * and the given payload into `frame`.
+ * 
+ * @return The length of the frame.
+ */
+uint32_t build_UDP_frame(struct tx_ring *ring, struct configurations *configs, unsigned char *frame, 
+	unsigned char *payload, uint32_t packet_id) {
+	struct ether_header *eth = (struct ether_header *) frame;
+	memcpy(eth->ether_dhost, ring->dst_mac, ETH_ALEN);
+	memcpy(eth->ether_shost, ring->src_mac, ETH_ALEN);
+	eth->ether_type = htons(ETHERTYPE_IP);
+
+	int udp_len = sizeof(struct udphdr) + configs->l;
+	struct ip *iphr = (struct ip *) (frame + sizeof(struct ether_header));
+	populate_ip_header(iphr, configs, IPPROTO_UDP, udp_len);
+	finish_ip_header(iphr, udp_len, configs->ttl, UDP_IPH_ID + packet_id);
+
+	struct udphdr *udphr = (struct udphdr *) ((unsigned char *) iphr + sizeof(struct ip));
+	udphr->uh_sport = htons(configs->udp_src_port);
+	udphr->uh_dport = htons(configs->udp_dst_port);
+	udphr->uh_ulen = htons(udp_len);
+	udphr->uh_sum = 0;
+	unsigned char *data = (unsigned char *) udphr + sizeof(struct udphdr);
+	memcpy(data, payload, configs->l);
+	fill_packet_id(data, packet_id);
+	udphr->uh_sum = udp_checksum(iphr, udphr, udp_len);
+	return sizeof(struct ether_header) + sizeof(struct ip) + udp_len;
+}
+
+/** 
+ * This function pre-builds one measurement in the ring: the head SYN, the n UDP packets carrying 
+ * `payload` with their packet IDs, and the tail SYN, in this order. The kernel keeps its position 
+ * in the ring across sends, so the measurement starts at the frame following the previous one, 
+ * wrapping around the end of the ring.
+ * 
+ * @param ring The TX ring set up by `setup_tx_ring`.
+ * @param configs The configuration structure containing addresses, ports and train parameters.
+ * @param payload The UDP payload template of size `l`.
+ */
+void fill_tx_ring(struct tx_ring *ring, struct configurations *configs, unsigned char *payload) {
+	ring->filled = configs->n + 2;
+	struct tpacket2_hdr *hdr = tx_frame(ring, ring->head);
+	hdr->tp_len = build_SYN_frame(ring, configs, (unsigned char *) hdr + TX_FRAME_DATA_OFFSET, 
+		configs->server_port_head_SYN);
+	for (uint32_t i = 0; i < configs->n; i++) {
+		hdr = tx_frame(ring, (ring->head + i + 1) % ring->frame_nr);
+		hdr->tp_len = build_UDP_frame(ring, configs, (unsigned char *) hdr + TX_FRAME_DATA_OFFSET, payload, i);
+	}
+	hdr = tx_frame(ring, (ring->head + configs->n + 1) % ring->frame_nr);
+	hdr->tp_len = build_SYN_frame(ring, configs, (unsigned char *) hdr + TX_FRAME_DATA_OFFSET, 
+		configs->server_port_tail_SYN);
+
+	// Hand the frames to the kernel only once all of them are written
+	for (uint32_t i = 0; i < ring->filled; i++) {
+		tx_frame(ring, (ring->head + i) % ring->frame_nr)->tp_status = TP_STATUS_SEND_REQUEST;
+	}
+}
+
+/** 
+ * This function transmits all the frames of the ring with a single `send` kick. The kernel walks 
+ * the ring in order, so the head SYN, the train and the tail SYN leave back to back and in order.
+ * It returns once all the frames have been handed to the device. If the device queue is full, the 
+ * kick is retried after the backoff of `backoff_on_enobufs`, and it resumes at the first frame that 
+ * was not sent.
+ * 
+ * @param ring The TX ring filled by `fill_tx_ring`.
+ * @return 0 on success, or -1 if the kernel failed to send the ring.
+ */
+int flush_tx_ring(struct tx_ring *ring) {
+	uint32_t attempt = 0;
+	while (send(ring->fd, NULL, 0, 0) == -1) {
+		if (errno == EINTR) continue;
+		if (errno == EAGAIN) errno = ENOBUFS; // frames are still queued in the device
+		if (backoff_on_enobufs(&attempt, NULL)) continue;
+		perror("Failed to send the TX ring");
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < ring->filled; i++) {
+		uint32_t frame = (ring->head + i) % ring->frame_nr;
+		uint32_t status = tx_frame(ring, frame)->tp_status;
+		if (status == TP_STATUS_WRONG_FORMAT) {
+			printf("The kernel rejected frame %u of the TX ring\n", frame);
+			return -1;
+		}
+		if (status == TP_STATUS_SEND_REQUEST) {
+			printf("The kernel did not send frame %u of the TX ring\n", frame);
+			return -1;
+		}
+	}
+	ring->head = (ring->head + ring->filled) % ring->frame_nr;
+	return 0;
+}
+
+/** 
+ * This function unmaps the ring and closes its packet socket.
+ * 
+ * @param ring The TX ring set up by `setup_tx_ring`.
+ */
+void close_tx_ring(struct tx_ring *ring) {
+	munmap(ring->map, ring->map_len);
+	close(ring->fd);
+}
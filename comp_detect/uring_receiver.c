@@ -0,0 +1,254 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "server.h"
+
+/** the buffer group the receive buffers are provided in */
+#define URING_BGID 0
+/** the number of submission queue entries; only the multishot request is ever submitted */
+#define URING_SQ_ENTRIES 8
+
+/** 
+ * This function creates an io_uring instance (there is no libc wrapper for the syscall).
+ * 
+ * @param entries The number of submission queue entries.
+ * @param params The setup parameters, filled with the ring offsets by the kernel.
+ * @return The io_uring file descriptor, or -1 on failure.
+ */
+int uring_setup(uint32_t entries, struct io_uring_params *params) {
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+/** 
+ * This function submits `to_submit` requests to an io_uring instance.
+ * 
+ * @return The number of submitted requests, or -1 on failure.
+ */
+int uring_enter(int ring_fd, uint32_t to_submit) {
+	return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, NULL, 0);
+}
+
+/** 
+ * This function returns a receive buffer to the kernel through the provided-buffer ring.
+ * 
+ * @param ur The io_uring receive engine.
+ * @param bid The ID of the buffer, its index in `bufs`.
+ */
+void provide_buffer(struct uring_receiver *ur, uint16_t bid) {
+	uint16_t tail = ur->buf_ring->tail;
+	struct io_uring_buf *buf = &ur->buf_ring->bufs[tail & (URING_BUF_COUNT - 1)];
+	buf->addr = (uint64_t) (uintptr_t) (ur->bufs + (size_t) bid * ur->buf_len);
+	buf->len = ur->buf_len;
+	buf->bid = bid;
+	// the kernel may consume the buffer as soon as it sees the new tail
+	__atomic_store_n(&ur->buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/** 
+ * This function submits the multishot recvmsg request on the UDP socket. Once armed, the kernel 
+ * posts one completion per received packet into a buffer picked from the provided-buffer ring, 
+ * until it runs out of buffers or completion queue space.
+ * 
+ * @param ur The io_uring receive engine.
+ * @return 0 on success, or -1 on failure.
+ */
+int arm_multishot_recvmsg(struct uring_receiver *ur) {
+	uint32_t tail = *ur->sq_tail;
+	uint32_t index = tail & *ur->sq_mask;
+	struct io_uring_sqe *sqe = &ur->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = ur->sock;
+	sqe->addr = (uint64_t) (uintptr_t) &ur->msg;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	ur->sq_array[index] = index;
+	__atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (uring_enter(ur->ring_fd, 1) != 1) {
+		perror("Failed to submit io_uring receive request");
+		return -1;
+	}
+	return 0;
+}
+
+/** 
+ * This function sets up the io_uring receive engine on a UDP socket: it creates the io_uring 
+ * instance, maps its rings, registers URING_BUF_COUNT receive buffers of room for the recvmsg 
+ * header, the timestamp cmsg and an `l` bytes payload as a provided-buffer ring, and arms one 
+ * multishot recvmsg request. In the steady state the kernel fills the buffers and posts the 
+ * completions without any syscall from the server.
+ * 
+ * @param ur The io_uring receive engine to set up.
+ * @param sock The UDP socket the packets are read from.
+ * @param l The size of the UDP payload of the packets.
+ * 
+ * @return 0 on success, or -1 if io_uring, provided-buffer rings or multishot recvmsg are unavailable.
+ */
+int setup_uring_receiver(struct uring_receiver *ur, int sock, uint32_t l) {
+	memset(ur, 0, sizeof(struct uring_receiver));
+	ur->sock = sock;
+
+	// One completion per packet: make room for a full buffer ring of them
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_BUF_COUNT;
+	ur->ring_fd = uring_setup(URING_SQ_ENTRIES, &params);
+	if (ur->ring_fd == -1) return -1;
+
+	ur->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	ur->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_ring_len > ur->sq_ring_len) ur->sq_ring_len = ur->cq_ring_len;
+		ur->cq_ring_len = 0;
+	}
+	ur->sq_ring = mmap(NULL, ur->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+		ur->ring_fd, IORING_OFF_SQ_RING);
+	if (ur->sq_ring == MAP_FAILED) {
+		ur->sq_ring = NULL;
+		close_uring_receiver(ur);
+		return -1;
+	}
+	ur->cq_ring = ur->sq_ring;
+	if (ur->cq_ring_len > 0) {
+		ur->cq_ring = mmap(NULL, ur->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+			ur->ring_fd, IORING_OFF_CQ_RING);
+		if (ur->cq_ring == MAP_FAILED) {
+			ur->cq_ring = NULL;
+			close_uring_receiver(ur);
+			return -1;
+		}
+	}
+	ur->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+		ur->ring_fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		ur->sqes = NULL;
+		close_uring_receiver(ur);
+		return -1;
+	}
+	ur->sq_tail = (uint32_t *) ((char *) ur->sq_ring + params.sq_off.tail);
+	ur->sq_mask = (uint32_t *) ((char *) ur->sq_ring + params.sq_off.ring_mask);
+	ur->sq_array = (uint32_t *) ((char *) ur->sq_ring + params.sq_off.array);
+	ur->cq_head = (uint32_t *) ((char *) ur->cq_ring + params.cq_off.head);
+	ur->cq_tail = (uint32_t *) ((char *) ur->cq_ring + params.cq_off.tail);
+	ur->cq_mask = (uint32_t *) ((char *) ur->cq_ring + params.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *) ((char *) ur->cq_ring + params.cq_off.cqes);
+
+	// The receive buffers and the ring providing them, both page aligned
+	ur->msg.msg_controllen = CMSG_SPACE(sizeof(struct timespec));
+	ur->buf_len = sizeof(struct io_uring_recvmsg_out) + ur->msg.msg_controllen + l;
+	ur->bufs_len = (size_t) URING_BUF_COUNT * ur->buf_len;
+	ur->bufs = mmap(NULL, ur->bufs_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	ur->buf_ring_len = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+	ur->buf_ring = mmap(NULL, ur->buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ur->bufs == MAP_FAILED || ur->buf_ring == MAP_FAILED) {
+		perror("Failed to map memory for the io_uring receive buffers");
+		if (ur->bufs == MAP_FAILED) ur->bufs = NULL;
+		if (ur->buf_ring == MAP_FAILED) ur->buf_ring = NULL;
+		close_uring_receiver(ur);
+		return -1;
+	}
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) ur->buf_ring;
+	reg.ring_entries = URING_BUF_COUNT;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, ur->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		close_uring_receiver(ur);
+		return -1;
+	}
+	for (uint32_t bid = 0; bid < URING_BUF_COUNT; bid++) {
+		provide_buffer(ur, bid);
+	}
+
+	if (arm_multishot_recvmsg(ur) == -1) {
+		close_uring_receiver(ur);
+		return -1;
+	}
+	return 0;
+}
+
+/** 
+ * This function reaps all available completions of the io_uring receive engine. Every completion 
+ * carries one packet in a provided buffer, laid out as a `struct io_uring_recvmsg_out`, the kernel 
+ * timestamp cmsg and the payload; the packet is handed to its session with `dispatch_packet` and 
+ * the buffer is handed back to the kernel. If the kernel ended the multishot request, because it 
+ * ran out of buffers or completion queue space, the request is armed again.
+ * 
+ * @param ur The io_uring receive engine.
+ * @param server The server the sessions of the packets are looked up in.
+ * @param worker The receive worker reading the engine, or NULL for the main thread.
+ * 
+ * @return 0 on success, or -1 if the receive request failed.
+ */
+int drain_uring_receiver(struct uring_receiver *ur, struct probe_server *server, struct recv_worker *worker) {
+	uint32_t head = *ur->cq_head;
+	uint32_t tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+	int rearm = 0;
+	struct timespec t_read;
+	clock_gettime(CLOCK_REALTIME, &t_read);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cq_mask];
+		if (!(cqe->flags & IORING_CQE_F_MORE)) rearm = 1;
+		if (cqe->res < 0) {
+			// out of buffers: the request ended, and is armed again once the buffers are back
+			if (cqe->res == -ENOBUFS) continue;
+			__atomic_store_n(ur->cq_head, head + 1, __ATOMIC_RELEASE);
+			errno = -cqe->res;
+			perror("Failed to receive UDP packets with io_uring");
+			return -1;
+		}
+		if (!(cqe->flags & IORING_CQE_F_BUFFER)) continue;
+
+		uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		unsigned char *buf = ur->bufs + (size_t) bid * ur->buf_len;
+		struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buf;
+		unsigned char *payload = buf + sizeof(struct io_uring_recvmsg_out) + ur->msg.msg_namelen + ur->msg.msg_controllen;
+		int payload_len = ur->buf_len - (payload - buf);
+		if ((int) out->payloadlen < payload_len) payload_len = out->payloadlen;
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = buf + sizeof(struct io_uring_recvmsg_out) + ur->msg.msg_namelen;
+		msg.msg_controllen = out->controllen;
+		struct timespec ts;
+		if (!rx_timestamp(&msg, &ts)) ts = t_read;
+		dispatch_packet(server, worker, payload, payload_len, &ts);
+		provide_buffer(ur, bid);
+	}
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+	if (rearm) return arm_multishot_recvmsg(ur);
+	return 0;
+}
+
+/** 
+ * This function releases the io_uring instance, its rings and the receive buffers. Closing the 
+ * io_uring cancels the multishot request. The UDP socket is left open.
+ * 
+ * @param ur The io_uring receive engine.
+ */
+void close_uring_receiver(struct uring_receiver *ur) {
+	if (ur->ring_fd != -1) close(ur->ring_fd);
+	if (ur->sqes != NULL) munmap(ur->sqes, ur->sqes_len);
+	if (ur->cq_ring != NULL && ur->cq_ring != ur->sq_ring) munmap(ur->cq_ring, ur->cq_ring_len);
+	if (ur->sq_ring != NULL) munmap(ur->sq_ring, ur->sq_ring_len);
+	if (ur->buf_ring != NULL) munmap(ur->buf_ring, ur->buf_ring_len);
+	if (ur->bufs != NULL) munmap(ur->bufs, ur->bufs_len);
+	memset(ur, 0, sizeof(struct uring_receiver));
+	ur->ring_fd = -1;
+}